@@ -38,10 +38,16 @@ void Initialize(const RSDP &rsdp) {
   }
 
   fadt = nullptr;
+  madt = nullptr;
+  hpet_table = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto &entry = xsdt[i];
     if (entry.IsValid("FACP")) {
       fadt = reinterpret_cast<const FADT *>(&entry);
+    } else if (entry.IsValid("APIC")) {
+      madt = reinterpret_cast<const MADT *>(&entry);
+    } else if (entry.IsValid("HPET")) {
+      hpet_table = reinterpret_cast<const HPETTable *>(&entry);
     }
   }
 
@@ -93,6 +99,8 @@ size_t XSDT::Count() const {
 }
 
 const FADT *fadt;
+const MADT *madt;
+const HPETTable *hpet_table;
 
 void WaitMilliseconds(unsigned long msec) {
   const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -104,4 +112,14 @@ void WaitMilliseconds(unsigned long msec) {
   while (IoIn32(fadt->pm_tmr_blk) < end);
 }
 
+// The PM timer counts at kPMTimerFreq and wraps at PMTimerMask().
+uint32_t ReadPMTimer() {
+  return IoIn32(fadt->pm_tmr_blk);
+}
+
+uint32_t PMTimerMask() {
+  const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+  return pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+}
+
 } // namespace acpi
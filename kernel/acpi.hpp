@@ -50,10 +50,58 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+struct MADT {
+  DescriptionHeader header;
+
+  uint32_t lapic_address;
+  uint32_t flags;
+
+  // Calls f(apic_id) for each processor that is enabled or can be brought
+  // online, in table order.
+  template <typename F>
+  void ForEachLAPIC(F f) const;
+} __attribute__((packed));
+
+struct HPETTable {
+  DescriptionHeader header;
+
+  uint32_t event_timer_block_id;
+  uint8_t address_space_id;  // 0: memory
+  uint8_t register_bit_width;
+  uint8_t register_bit_offset;
+  uint8_t reserved;
+  uint64_t address;
+  uint8_t hpet_number;
+  uint16_t minimum_tick;
+  uint8_t page_protection;
+} __attribute__((packed));
+
+template <typename F>
+void MADT::ForEachLAPIC(F f) const {
+  auto p = reinterpret_cast<const uint8_t *>(this + 1);
+  const auto end = reinterpret_cast<const uint8_t *>(this) + header.length;
+  while (p < end) {
+    const uint8_t type = p[0], length = p[1];
+    if (length < 2) {
+      break;
+    }
+    if (type == 0 && (p[4] & 0b11)) {  // Processor Local APIC
+      f(static_cast<uint32_t>(p[3]));
+    } else if (type == 9 && (p[8] & 0b11)) {  // Processor Local x2APIC
+      f(*reinterpret_cast<const uint32_t *>(p + 4));
+    }
+    p += length;
+  }
+}
+
 extern const FADT *fadt;
+extern const MADT *madt;
+extern const HPETTable *hpet_table;  // nullptr if the firmware has no HPET
 const int kPMTimerFreq = 3579545;
 
 void WaitMilliseconds(unsigned long msec);
+uint32_t ReadPMTimer();
+uint32_t PMTimerMask();
 void Initialize(const RSDP &rsdp);
 
 } // namespace acpi
@@ -76,6 +76,40 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR0
+GetCR0:
+    mov rax, cr0
+    ret
+
+global GetCR4
+GetCR4:
+    mov rax, cr4
+    ret
+
+global ReadTSC
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR
+ReadMSR:  ; uint64_t ReadMSR(uint32_t msr);
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR
+WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -87,8 +121,7 @@ KernelMain:
     hlt
     jmp .fin
 
-global SwitchContext
-SwitchContext:
+%macro SAVE_CONTEXT 0  ; saves the caller's context to [rsi]
     mov [rsi + 0x40], rax
     mov [rsi + 0x48], rbx
     mov [rsi + 0x50], rcx
@@ -126,22 +159,9 @@ SwitchContext:
     mov [rsi + 0x38], rax
 
     fxsave [rsi + 0xc0]
+%endmacro
 
-    push qword [rdi + 0x28]  ; SS
-    push qword [rdi + 0x70]  ; RSP
-    push qword [rdi + 0x10]  ; RFLAGS
-    push qword [rdi + 0x20]  ; CS
-    push qword [rdi + 0x08]  ; RIP
-
-    fxrstor [rdi + 0xc0]
-
-    mov rax, [rdi + 0x00]
-    mov cr3, rax
-    mov rax, [rdi + 0x30]
-    mov fs, ax
-    mov rax, [rdi + 0x38]
-    mov gs, ax
-
+%macro RESTORE_GPRS 0  ; loads general purpose registers from [rdi]
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
     mov rcx, [rdi + 0x50]
@@ -158,5 +178,192 @@ SwitchContext:
     mov r15, [rdi + 0xb8]
 
     mov rdi, [rdi + 0x60]
+%endmacro
+
+global SwitchContext
+SwitchContext:
+    SAVE_CONTEXT
+
+    push qword [rdi + 0x28]  ; SS
+    push qword [rdi + 0x70]  ; RSP
+    push qword [rdi + 0x10]  ; RFLAGS
+    push qword [rdi + 0x20]  ; CS
+    push qword [rdi + 0x08]  ; RIP
+
+    fxrstor [rdi + 0xc0]
+
+    mov rax, [rdi + 0x00]
+    mov cr3, rax
+    mov rax, [rdi + 0x30]
+    mov fs, ax
+    ; GS is left alone: loading it would clear the per-CPU GS base.
+
+    RESTORE_GPRS
 
     o64 iret
+
+; void SwitchContextFast(void *next_ctx, void *current_ctx);
+; Same as SwitchContext, but CR3 and FS are written only when they differ
+; from the current ones, and a switch that keeps CS and SS returns with
+; popfq/ret on the target stack instead of iret.
+global SwitchContextFast
+SwitchContextFast:
+    SAVE_CONTEXT
+
+    fxrstor [rdi + 0xc0]
+
+    mov rax, [rdi + 0x00]
+    cmp rax, [rsi + 0x00]
+    je .cr3_done
+    mov cr3, rax
+.cr3_done:
+    mov rax, [rdi + 0x30]
+    cmp ax, [rsi + 0x30]
+    je .fs_done
+    mov fs, ax
+.fs_done:
+    mov rax, [rdi + 0x20]
+    cmp ax, [rsi + 0x20]
+    jne .iret
+    mov rax, [rdi + 0x28]
+    cmp ax, [rsi + 0x28]
+    jne .iret
+
+    mov rsp, [rdi + 0x70]
+    push qword [rdi + 0x08]  ; RIP
+    push qword [rdi + 0x10]  ; RFLAGS
+    RESTORE_GPRS
+    popfq
+    ret
+
+.iret:
+    push qword [rdi + 0x28]  ; SS
+    push qword [rdi + 0x70]  ; RSP
+    push qword [rdi + 0x10]  ; RFLAGS
+    push qword [rdi + 0x20]  ; CS
+    push qword [rdi + 0x08]  ; RIP
+    RESTORE_GPRS
+    o64 iret
+
+; void SwitchFiber(uint64_t *current_sp, uint64_t next_sp);
+; Saves only what the SysV ABI requires a callee to preserve: rbx, rbp,
+; r12-r15 and the MXCSR/x87 control words.
+global SwitchFiber
+SwitchFiber:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    sub rsp, 8
+    stmxcsr [rsp]
+    fnstcw [rsp + 4]
+    mov [rdi], rsp
+
+    mov rsp, rsi
+    ldmxcsr [rsp]
+    fldcw [rsp + 4]
+    add rsp, 8
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+extern FiberMain
+
+; First return address of a new fiber. r12 holds the fiber.
+global FiberTrampoline
+FiberTrampoline:
+    mov rdi, r12
+    call FiberMain
+.fin:
+    hlt
+    jmp .fin
+
+; Startup code for application processors. InitializeSMP() copies it to a
+; page below 1 MiB, fills in the parameters at ApBootParams and sends a
+; startup IPI, which enters it in real mode at CS:0.
+bits 16
+global ApTrampoline
+ApTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4  ; linear address of ApTrampoline
+
+    lea eax, [ebx + ap_gdt - ApTrampoline]
+    mov [ap_gdtr - ApTrampoline + 2], eax
+    lea eax, [ebx + ap_protected - ApTrampoline]
+    mov [ap_far32 - ApTrampoline], eax
+    lea eax, [ebx + ap_long - ApTrampoline]
+    mov [ap_far64 - ApTrampoline], eax
+
+    o32 lgdt [ap_gdtr - ApTrampoline]
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    jmp dword far [ap_far32 - ApTrampoline]
+
+bits 32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, [ebx + ap_cr4 - ApTrampoline]
+    mov cr4, eax
+    mov eax, [ebx + ap_cr3 - ApTrampoline]
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+    mov eax, [ebx + ap_cr0 - ApTrampoline]
+    mov cr0, eax  ; enables paging and long mode
+    jmp far [ebx + ap_far64 - ApTrampoline]
+
+bits 64
+ap_long:
+    mov ebx, ebx
+    mov rsp, [rbx + ap_stack - ApTrampoline]
+    mov rdi, [rbx + ap_cpu - ApTrampoline]
+    mov rax, [rbx + ap_entry - ApTrampoline]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08: 32-bit code
+    dq 0x00cf92000000ffff  ; 0x10: data
+    dq 0x00af9a000000ffff  ; 0x18: 64-bit code
+ap_gdtr:
+    dw 4 * 8 - 1
+    dd 0
+ap_far32:
+    dd 0
+    dw 0x08
+ap_far64:
+    dd 0
+    dw 0x18
+
+align 8
+global ApBootParams  ; layout of APBootParams in smp.cpp
+ApBootParams:
+ap_cr0:   dq 0
+ap_cr3:   dq 0
+ap_cr4:   dq 0
+ap_stack: dq 0
+ap_entry: dq 0
+ap_cpu:   dq 0
+global ApTrampolineEnd
+ApTrampolineEnd:
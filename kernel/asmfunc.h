@@ -12,5 +12,14 @@ extern "C" {
   void SetCSSS(uint16_t cs, uint16_t ss);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR0();
+  uint64_t GetCR4();
+  uint64_t ReadTSC();
+  uint64_t ReadMSR(uint32_t msr);
+  void WriteMSR(uint32_t msr, uint64_t value);
   void SwitchContext(void *next_ctx, void *current_ctx);
+  void SwitchContextFast(void *next_ctx, void *current_ctx);
+  void SwitchFiber(uint64_t *current_sp, uint64_t next_sp);
+  void FiberTrampoline();
+  extern char ApTrampoline[], ApBootParams[], ApTrampolineEnd[];
 }
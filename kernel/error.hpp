@@ -31,6 +31,9 @@ class Error {
     kNoSuchTask,
     kInvalidFormat,
     kFrameTooSmall,
+    kInvalidAffinity,
+    kInvalidDeadline,
+    kOvercommit,
     kLastOfCode,
   };
 
@@ -61,6 +64,9 @@ class Error {
     "kNoSuchTask",
     "kInvalidFormat",
     "kFrameTooSmall",
+    "kInvalidAffinity",
+    "kInvalidDeadline",
+    "kOvercommit",
   };
 
  public:
@@ -0,0 +1,105 @@
+#include "fiber.hpp"
+
+#include "asmfunc.h"
+
+FiberScheduler::FiberScheduler(size_t max_fibers)
+    : fibers_(max_fibers), stacks_(max_fibers * kStackBytes / sizeof(uint64_t)) {
+  for (size_t i = 0; i < max_fibers; ++i) {
+    fibers_[i].stack_ = &stacks_[i * kStackBytes / sizeof(uint64_t)];
+    fibers_[i].scheduler_ = this;
+    fibers_[i].next_ = free_;
+    free_ = &fibers_[i];
+  }
+}
+
+WithError<Fiber *> FiberScheduler::Spawn(FiberFunc *f, int64_t data) {
+  Fiber *fiber = free_;
+  if (fiber == nullptr) {
+    return { nullptr, MAKE_ERROR(Error::kFull) };
+  }
+  free_ = fiber->next_;
+
+  fiber->func_ = f;
+  fiber->data_ = data;
+
+  // Initial frame popped by SwitchFiber: MXCSR/FCW, r15, r14, r13, r12, rbx,
+  // rbp and the return address. The stack is 16-byte aligned after the
+  // return, as FiberTrampoline expects.
+  const size_t stack_words = kStackBytes / sizeof(uint64_t);
+  uint64_t *sp = (fiber->stack_ + stack_words) - 10;
+  sp[0] = (uint64_t{0x037f} << 32) | 0x1f80;
+  sp[1] = sp[2] = sp[3] = sp[5] = sp[6] = 0;
+  sp[4] = reinterpret_cast<uint64_t>(fiber);  // r12
+  sp[7] = reinterpret_cast<uint64_t>(FiberTrampoline);
+  sp[8] = sp[9] = 0;
+  fiber->sp_ = reinterpret_cast<uint64_t>(sp);
+
+  PushReady(fiber);
+  return { fiber, MAKE_ERROR(Error::kSuccess) };
+}
+
+// Runs ready fibers until none is left, then returns to the caller.
+void FiberScheduler::Run() {
+  while (Fiber *fiber = PopReady()) {
+    current_ = fiber;
+    SwitchFiber(&host_sp_, fiber->sp_);
+    current_ = nullptr;
+
+    if (fiber->state_ == Fiber::State::kDone) {
+      fiber->state_ = Fiber::State::kFree;
+      fiber->next_ = free_;
+      free_ = fiber;
+    }
+  }
+}
+
+void FiberScheduler::Yield() {
+  Fiber *fiber = current_;
+  PushReady(fiber);
+  SwitchFiber(&fiber->sp_, host_sp_);
+}
+
+void FiberScheduler::Park() {
+  Fiber *fiber = current_;
+  fiber->state_ = Fiber::State::kParked;
+  SwitchFiber(&fiber->sp_, host_sp_);
+}
+
+void FiberScheduler::Unpark(Fiber *fiber) {
+  if (fiber->state_ == Fiber::State::kParked) {
+    PushReady(fiber);
+  }
+}
+
+void FiberScheduler::PushReady(Fiber *fiber) {
+  fiber->state_ = Fiber::State::kReady;
+  fiber->next_ = nullptr;
+  if (ready_tail_) {
+    ready_tail_->next_ = fiber;
+  } else {
+    ready_head_ = fiber;
+  }
+  ready_tail_ = fiber;
+}
+
+Fiber *FiberScheduler::PopReady() {
+  Fiber *fiber = ready_head_;
+  if (fiber) {
+    ready_head_ = fiber->next_;
+    if (ready_head_ == nullptr) {
+      ready_tail_ = nullptr;
+    }
+  }
+  return fiber;
+}
+
+void FiberScheduler::Finish(Fiber *fiber) {
+  fiber->state_ = Fiber::State::kDone;
+  uint64_t unused_sp;
+  SwitchFiber(&unused_sp, host_sp_);
+}
+
+extern "C" void FiberMain(Fiber *fiber) {
+  fiber->func_(fiber->data_);
+  fiber->scheduler_->Finish(fiber);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+
+using FiberFunc = void (int64_t);
+
+class Fiber;
+class FiberScheduler;
+
+extern "C" void FiberMain(Fiber *fiber);
+
+// A cooperatively scheduled thread of execution. Many fibers run on one
+// kernel task, and switching between them saves only callee-saved state.
+class Fiber {
+ public:
+  enum class State {
+    kFree,
+    kReady,
+    kParked,
+    kDone,
+  };
+
+  State GetState() const { return state_; }
+
+ private:
+  uint64_t sp_{0};
+  uint64_t *stack_{nullptr};
+  FiberFunc *func_{nullptr};
+  int64_t data_{0};
+  State state_{State::kFree};
+  Fiber *next_{nullptr};
+  FiberScheduler *scheduler_{nullptr};
+
+  friend FiberScheduler;
+  friend void FiberMain(Fiber *fiber);
+};
+
+// Runs fibers on the kernel task that calls Run(). Fibers and their stacks
+// come from pools allocated up front. All methods must be called on that
+// task; Yield() and Park() only from inside a fiber.
+class FiberScheduler {
+ public:
+  static const size_t kStackBytes = 4096;
+
+  FiberScheduler(size_t max_fibers);
+  WithError<Fiber *> Spawn(FiberFunc *f, int64_t data);
+  void Run();
+  void Yield();
+  void Park();
+  void Unpark(Fiber *fiber);
+  Fiber *Current() const { return current_; }
+
+ private:
+  std::vector<Fiber> fibers_;
+  std::vector<uint64_t> stacks_;
+  Fiber *free_{nullptr};
+  Fiber *ready_head_{nullptr}, *ready_tail_{nullptr};
+  Fiber *current_{nullptr};
+  uint64_t host_sp_{0};
+
+  void PushReady(Fiber *fiber);
+  Fiber *PopReady();
+  void Finish(Fiber *fiber);
+
+  friend void FiberMain(Fiber *fiber);
+};
@@ -76,6 +76,32 @@ Rectangle<T> operator &(const Rectangle<T> &lhs, const Rectangle<U> &rhs) {
   return {new_pos, new_size};
 }
 
+// Smallest rectangle that contains both. An empty rectangle contributes
+// nothing.
+template <typename T, typename U>
+Rectangle<T> operator |(const Rectangle<T> &lhs, const Rectangle<U> &rhs) {
+  if (lhs.size.x <= 0 || lhs.size.y <= 0) {
+    return {{rhs.pos.x, rhs.pos.y}, {rhs.size.x, rhs.size.y}};
+  } else if (rhs.size.x <= 0 || rhs.size.y <= 0) {
+    return lhs;
+  }
+
+  const auto lhs_end = lhs.pos + lhs.size;
+  const auto rhs_end = rhs.pos + rhs.size;
+
+  Vector2D<T> new_pos = {
+    std::min<T>(lhs.pos.x, rhs.pos.x),
+    std::min<T>(lhs.pos.y, rhs.pos.y),
+  };
+
+  Vector2D<T> new_size = {
+    std::max<T>(lhs_end.x, rhs_end.x) - new_pos.x,
+    std::max<T>(lhs_end.y, rhs_end.y) - new_pos.y,
+  };
+
+  return {new_pos, new_size};
+}
+
 class PixelWriter {
  public:
   virtual ~PixelWriter() = default;
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Histogram with power-of-two buckets: bucket i counts values in [2^i, 2^(i+1)).
+class Histogram {
+ public:
+  static const int kBuckets = 48;
+
+  void Record(uint64_t value) {
+    int i = value == 0 ? 0 : 63 - __builtin_clzll(value);
+    if (i >= kBuckets) {
+      i = kBuckets - 1;
+    }
+    ++buckets_[i];
+    ++count_;
+    sum_ += value;
+    if (value > max_) {
+      max_ = value;
+    }
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+  uint64_t Average() const { return count_ == 0 ? 0 : sum_ / count_; }
+  uint64_t Bucket(int i) const { return buckets_[i]; }
+
+  // Upper bound of the bucket that contains the given percentile.
+  uint64_t Percentile(int percent) const {
+    const uint64_t threshold = (count_ * percent + 99) / 100;
+    uint64_t acc = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      acc += buckets_[i];
+      if (acc >= threshold && acc > 0) {
+        return (uint64_t{2} << i) - 1;
+      }
+    }
+    return max_;
+  }
+
+ private:
+  std::array<uint64_t, kBuckets> buckets_{};
+  uint64_t count_{0};
+  uint64_t sum_{0};
+  uint64_t max_{0};
+};
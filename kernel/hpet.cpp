@@ -0,0 +1,143 @@
+#include "hpet.hpp"
+
+#include "acpi.hpp"
+#include "interrupt.hpp"
+#include "ktime.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+
+namespace {
+  const uint64_t kFemtosecondsPerSecond = 1000000000000000;
+  const uint64_t kMaxPeriod = 100000000;  // fs, i.e. 10 MHz at the slowest
+
+  // General registers
+  const uintptr_t kCapabilities = 0x000;
+  const uintptr_t kConfig = 0x010;
+  const uintptr_t kMainCounter = 0x0f0;
+  // Registers of comparator n
+  uintptr_t TimerConfig(int n) { return 0x100 + 0x20 * n; }
+  uintptr_t TimerComparator(int n) { return 0x108 + 0x20 * n; }
+  uintptr_t TimerFSBRoute(int n) { return 0x110 + 0x20 * n; }
+
+  const uint64_t kCapCounter64 = 1u << 13;
+  const uint64_t kConfigEnable = 1u << 0;
+  const uint64_t kConfigLegacyRoute = 1u << 1;
+  const uint64_t kTimerLevelTrigger = 1u << 1;
+  const uint64_t kTimerIntEnable = 1u << 2;
+  const uint64_t kTimerPeriodic = 1u << 3;
+  const uint64_t kTimerCap64 = 1u << 5;
+  const uint64_t kTimer32Mode = 1u << 8;
+  const uint64_t kTimerFSBEnable = 1u << 14;
+  const uint64_t kTimerFSBCap = 1u << 15;
+
+  uintptr_t base;  // 0 if there is no usable HPET
+  uint64_t period;  // fs per count
+  uint64_t freq;
+  // ns = counts * ns_mult >> 32, as in ktime.
+  uint64_t ns_mult;
+  int one_shot_timer = -1;
+
+  volatile uint64_t &Register(uintptr_t offset) {
+    return *reinterpret_cast<volatile uint64_t *>(base + offset);
+  }
+
+  // Picks a 64-bit comparator that can deliver its interrupt as an MSI
+  // (FSB) message. Without an I/O APIC driver that is the only way to route
+  // it. Comparators 0 and 1 are avoided if possible, since firmware may
+  // have them wired to the legacy PIT and RTC lines.
+  int FindOneShotTimer(int num_timers) {
+    int found = -1;
+    for (int n = num_timers - 1; n >= 0; --n) {
+      const uint64_t config = Register(TimerConfig(n));
+      if ((config & kTimerCap64) && (config & kTimerFSBCap)) {
+        found = n;
+        if (n >= 2) {
+          break;
+        }
+      }
+    }
+    return found;
+  }
+
+  void SetupOneShotTimer(int n) {
+    const uint64_t msg_addr = 0xfee00000u | (per_cpu[0].apic_id << 12);
+    const uint64_t msg_data = InterruptVector::kHPETTimer;  // fixed, edge
+    Register(TimerFSBRoute(n)) = (msg_addr << 32) | msg_data;
+
+    uint64_t config = Register(TimerConfig(n));
+    config &= ~(kTimerLevelTrigger | kTimerIntEnable | kTimerPeriodic | kTimer32Mode);
+    config |= kTimerFSBEnable;
+    Register(TimerConfig(n)) = config;
+  }
+}
+
+namespace hpet {
+
+bool Initialize() {
+  const auto table = acpi::hpet_table;
+  if (table == nullptr || table->address_space_id != 0 || table->address == 0) {
+    Log(kInfo, "HPET: not found\n");
+    return false;
+  }
+
+  // The HPET registers lie below 4 GiB, in the identity-mapped range.
+  base = table->address;
+  const uint64_t cap = Register(kCapabilities);
+  period = cap >> 32;
+  if (period == 0 || period > kMaxPeriod || (cap & kCapCounter64) == 0) {
+    Log(kWarn, "HPET: unusable (period %lu fs, cap %lx)\n", period, cap);
+    base = 0;
+    return false;
+  }
+  freq = kFemtosecondsPerSecond / period;
+  ns_mult = (ktime::kNanosecondsPerSecond << 32) / freq;
+  const int num_timers = ((cap >> 8) & 0x1f) + 1;
+
+  Register(kConfig) = Register(kConfig) & ~(kConfigEnable | kConfigLegacyRoute);
+  for (int n = 0; n < num_timers; ++n) {
+    Register(TimerConfig(n)) = Register(TimerConfig(n)) & ~kTimerIntEnable;
+  }
+  one_shot_timer = FindOneShotTimer(num_timers);
+  if (one_shot_timer >= 0) {
+    SetupOneShotTimer(one_shot_timer);
+  }
+  Register(kConfig) = Register(kConfig) | kConfigEnable;
+
+  Log(kInfo, "HPET: %lu Hz, %d comparators, one-shot on #%d\n",
+      freq, num_timers, one_shot_timer);
+  return true;
+}
+
+bool Available() {
+  return base != 0;
+}
+
+uint64_t Frequency() {
+  return freq;
+}
+
+uint64_t ReadCounter() {
+  return Register(kMainCounter);
+}
+
+const volatile uint64_t *CounterAddress() {
+  return &Register(kMainCounter);
+}
+
+uint64_t CounterToNanoseconds(uint64_t counts) {
+  return static_cast<unsigned __int128>(counts) * ns_mult >> 32;
+}
+
+bool OneShotAvailable() {
+  return one_shot_timer >= 0;
+}
+
+bool ArmOneShot(uint64_t counter) {
+  const int n = one_shot_timer;
+  Register(TimerComparator(n)) = counter;
+  Register(TimerConfig(n)) = Register(TimerConfig(n)) | kTimerIntEnable;
+  // The counter may have passed the comparator while it was written.
+  return static_cast<int64_t>(counter - ReadCounter()) > 0;
+}
+
+} // namespace hpet
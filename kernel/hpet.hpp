@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+// High Precision Event Timer. Its main counter runs at a fixed rate of at
+// least 10 MHz whatever the CPU frequency, and is read with a single MMIO
+// load, unlike the ACPI PM timer behind port I/O. One comparator can raise
+// one-shot interrupts on InterruptVector::kHPETTimer at the BSP.
+namespace hpet {
+
+// Finds the HPET through acpi::hpet_table and starts its main counter.
+// Returns false if there is no usable HPET. Must be called after
+// acpi::Initialize() and InitializePerCPU(0).
+bool Initialize();
+
+bool Available();
+uint64_t Frequency();  // counts per second
+uint64_t ReadCounter();
+const volatile uint64_t *CounterAddress();
+uint64_t CounterToNanoseconds(uint64_t counts);
+
+// Whether a comparator could be set up for ArmOneShot().
+bool OneShotAvailable();
+
+// Requests an interrupt when the main counter reaches counter. Returns false
+// if the counter had already reached it; the interrupt may then not come
+// until the counter wraps, so the caller must handle the expiry itself.
+bool ArmOneShot(uint64_t counter);
+
+} // namespace hpet
@@ -2,7 +2,9 @@
 #include <cstdint>
 #include "asmfunc.h"
 #include "interrupt.hpp"
+#include "lapic.hpp"
 #include "segment.hpp"
+#include "softirq.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
@@ -20,21 +22,59 @@ void SetIDTEntry(InterruptDescriptor &desc,
 }
 
 void NotifyEndOfInterrupt() {
-  volatile auto end_of_interrupt = reinterpret_cast<uint32_t *>(0xfee000b0);
-  *end_of_interrupt = 0;
+  lapic::Write(lapic::kEOI, 0);
 }
 
+namespace {
+  std::array<IRQStats, 256> irq_stats;
+}
+
+void RecordIRQ(uint8_t vector, uint64_t entry_tsc) {
+  auto &stats = irq_stats[vector];
+  ++stats.count;
+  stats.duration.Record(ReadTSC() - entry_tsc);
+}
+
+IRQStats GetIRQStats(uint8_t vector) {
+  return irq_stats[vector];
+}
+
+volatile uint64_t xhci_irq_tsc;
+uint64_t xhci_event_tsc;
+
 namespace {
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame *frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    const uint64_t entry_tsc = ReadTSC();
+    if (xhci_irq_tsc == 0) {
+      xhci_irq_tsc = entry_tsc;
+    }
+    RaiseSoftIRQ(kSoftIRQXHCI);
     NotifyEndOfInterrupt();
+    RecordIRQ(InterruptVector::kXHCI, entry_tsc);
+    if (RunSoftIRQs()) {
+      task_manager->ReschedIfNeeded();
+    }
   }
 
   __attribute__((interrupt))
   void IntHandlerLAPICTimer(InterruptFrame *frame) {
     LAPICTimerInterrupt();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerHPETTimer(InterruptFrame *frame) {
+    HPETTimerInterrupt();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerReschedule(InterruptFrame *frame) {
+    const uint64_t entry_tsc = ReadTSC();
     NotifyEndOfInterrupt();
+    RecordIRQ(InterruptVector::kReschedule, entry_tsc);
+    if (RunSoftIRQs()) {
+      task_manager->ReschedIfNeeded();
+    }
   }
 }
 
@@ -49,5 +89,19 @@ void InitializeInterrupt() {
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
 
+  SetIDTEntry(idt[InterruptVector::kReschedule],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerReschedule),
+              kKernelCS);
+
+  SetIDTEntry(idt[InterruptVector::kHPETTimer],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerHPETTimer),
+              kKernelCS);
+
+  LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+}
+
+void InitializeInterruptAP() {
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
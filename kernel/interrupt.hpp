@@ -3,6 +3,7 @@
 #include <array>
 #include <cstdint>
 
+#include "histogram.hpp"
 #include "message.hpp"
 #include "x86_descriptor.hpp"
 
@@ -52,6 +53,8 @@ class InterruptVector {
   enum Number {
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kReschedule = 0x42,  // IPI: the target CPU should call ReschedIfNeeded()
+    kHPETTimer = 0x43,
   };
 };
 
@@ -65,4 +68,22 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+// Per-vector accounting of interrupt handlers. Updates from different CPUs
+// are not synchronized, so the numbers are approximate.
+struct IRQStats {
+  uint64_t count;
+  Histogram duration;  // TSC cycles from handler entry to before softirqs
+};
+
+// Called by a handler after its EOI and before RunSoftIRQs(), with the TSC
+// read on entry. Softirqs and task switches are left out of the duration.
+void RecordIRQ(uint8_t vector, uint64_t entry_tsc);
+IRQStats GetIRQStats(uint8_t vector);
+
+// TSC of the oldest xHCI interrupt not yet taken by the main task, and of
+// the interrupt whose events are being processed now.
+extern volatile uint64_t xhci_irq_tsc;
+extern uint64_t xhci_event_tsc;
+
 void InitializeInterrupt();
+void InitializeInterruptAP();
@@ -1,5 +1,8 @@
 #include <memory>
+#include "asmfunc.h"
+#include "interrupt.hpp"
 #include "keyboard.hpp"
+#include "sync.hpp"
 #include "task.hpp"
 #include "usb/classdriver/keyboard.hpp"
 
@@ -46,8 +49,23 @@ const int kRShiftBitMask   = 0b00100000u;
 const int kRAltBitMask     = 0b01000000u;
 const int kRGUIBitMask     = 0b10000000u;
 
+LockStats key_latency_lock_stats{"key_latency"};
+SpinLock key_latency_lock{&key_latency_lock_stats};
+Histogram key_latency;
+
 } // namespace
 
+void RecordKeyLatency(uint64_t irq_tsc) {
+  const uint64_t now = ReadTSC();
+  SpinLockGuard guard{key_latency_lock};
+  key_latency.Record(now - irq_tsc);
+}
+
+Histogram KeyLatency() {
+  SpinLockGuard guard{key_latency_lock};
+  return key_latency;
+}
+
 void InitializeKeyboard() {
   usb::HIDKeyboardDriver::default_observer =
     [](uint8_t modifier, uint8_t keycode) {
@@ -60,6 +78,7 @@ void InitializeKeyboard() {
       msg.arg.keyboard.modifier = modifier;
       msg.arg.keyboard.keycode = keycode;
       msg.arg.keyboard.ascii = ascii;
+      msg.arg.keyboard.irq_tsc = xhci_event_tsc;
       task_manager->SendMessage(1, msg);
     };
 }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include "histogram.hpp"
 #include "message.hpp"
 
+// TSC cycles from the xHCI interrupt that delivered a key until the key is
+// drawn by the window that received it.
+void RecordKeyLatency(uint64_t irq_tsc);
+Histogram KeyLatency();
+
 void InitializeKeyboard();
@@ -0,0 +1,89 @@
+#include "ktime.hpp"
+
+#include <cpuid.h>
+
+#include "asmfunc.h"
+#include "hpet.hpp"
+#include "logger.hpp"
+
+namespace {
+  uint64_t tsc_freq;
+  // ns = cycles * ns_mult >> 32, so that Now() needs no division.
+  uint64_t ns_mult;
+
+  ktime::ClockSource source = ktime::ClockSource::kTSC;
+  uint64_t base_ns;  // Now() when the current source was chosen
+  uint64_t base_count;  // reading of the current source at that time
+
+  uint64_t ReadSource() {
+    return source == ktime::ClockSource::kHPET ? hpet::ReadCounter() : ReadTSC();
+  }
+}
+
+namespace ktime {
+
+void Initialize(uint64_t freq) {
+  tsc_freq = freq;
+  ns_mult = (kNanosecondsPerSecond << 32) / freq;
+  source = ClockSource::kTSC;
+  base_ns = 0;
+  base_count = ReadTSC();
+
+  if (!InvariantTSC()) {
+    Log(kWarn, "TSC is not invariant: the clock may drift with the CPU frequency\n");
+  }
+  Log(kInfo, "TSC: %lu Hz\n", freq);
+}
+
+uint64_t Now() {
+  const uint64_t elapsed = ReadSource() - base_count;
+  if (source == ClockSource::kHPET) {
+    return base_ns + hpet::CounterToNanoseconds(elapsed);
+  }
+  return base_ns + TSCToNanoseconds(elapsed);
+}
+
+void FillClockPage(ClockPage &page) {
+  page.base_ns = Now();
+  page.base_count = ReadSource();
+  if (source == ClockSource::kHPET) {
+    page.ns_mult = (kNanosecondsPerSecond << 32) / hpet::Frequency();
+    page.hpet_counter = hpet::CounterAddress();
+  } else {
+    page.ns_mult = ns_mult;
+    page.hpet_counter = nullptr;
+  }
+}
+
+void SetClockSource(ClockSource new_source) {
+  base_ns = Now();
+  source = new_source;
+  base_count = ReadSource();
+  Log(kInfo, "clock source: %s\n", source == ClockSource::kHPET ? "HPET" : "TSC");
+}
+
+ClockSource CurrentClockSource() {
+  return source;
+}
+
+bool InvariantTSC() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (edx >> 8) & 1;
+}
+
+uint64_t TSCFrequency() {
+  return tsc_freq;
+}
+
+uint64_t TSCToNanoseconds(uint64_t cycles) {
+  return static_cast<unsigned __int128>(cycles) * ns_mult >> 32;
+}
+
+uint64_t NanosecondsToTSC(uint64_t ns) {
+  return static_cast<unsigned __int128>(ns) * tsc_freq / kNanosecondsPerSecond;
+}
+
+} // namespace ktime
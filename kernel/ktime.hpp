@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+// Monotonic clock with nanosecond resolution, read from the TSC, or from the
+// HPET when the TSC is not invariant. The TSC frequency is measured against
+// the ACPI PM timer at boot.
+//
+// The namespace is not called clock so as not to clash with clock() of the
+// C library.
+namespace ktime {
+
+const uint64_t kNanosecondsPerSecond = 1000000000;
+
+enum class ClockSource {
+  kTSC,
+  kHPET,
+};
+
+// Called once the TSC frequency is known. Time starts at 0 here.
+void Initialize(uint64_t tsc_freq);
+
+// Nanoseconds since Initialize().
+uint64_t Now();
+
+// What an app needs to compute Now() itself. The terminal maps a copy at
+// kClockPageAddress into every app, so that apps read the clock without
+// calling into the kernel at an address that changes with each link.
+struct ClockPage {
+  uint64_t base_ns;
+  uint64_t base_count;
+  uint64_t ns_mult;  // ns = counts * ns_mult >> 32
+  const volatile uint64_t *hpet_counter;  // nullptr if the source is the TSC
+};
+
+// Last page of the region apps are loaded into.
+const uintptr_t kClockPageAddress = 0xffff'807f'ffff'f000;
+
+void FillClockPage(ClockPage &page);
+
+inline uint64_t Now(const ClockPage &page) {
+  uint64_t count;
+  if (page.hpet_counter) {
+    count = *page.hpet_counter;
+  } else {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    count = (uint64_t{hi} << 32) | lo;
+  }
+  return page.base_ns +
+    (static_cast<unsigned __int128>(count - page.base_count) * page.ns_mult >> 32);
+}
+
+// Switches Now() to another source, continuing from the current time.
+void SetClockSource(ClockSource source);
+ClockSource CurrentClockSource();
+bool InvariantTSC();
+
+uint64_t TSCFrequency();
+uint64_t TSCToNanoseconds(uint64_t cycles);
+uint64_t NanosecondsToTSC(uint64_t ns);
+
+} // namespace ktime
@@ -0,0 +1,63 @@
+#include "lapic.hpp"
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+  const uint32_t kIA32APICBase = 0x1b;
+  const uint64_t kAPICBaseEnable = 1u << 11;
+  const uint64_t kAPICBaseX2APIC = 1u << 10;
+  const uint32_t kICRPending = 1 << 12;
+
+  void EnableX2APIC() {
+    const uint64_t base = ReadMSR(kIA32APICBase);
+    WriteMSR(kIA32APICBase, base | kAPICBaseEnable | kAPICBaseX2APIC);
+  }
+}
+
+namespace lapic {
+
+bool x2apic_mode = false;
+
+uint32_t ID() {
+  if (x2apic_mode) {
+    return Read(kID);
+  }
+  return Read(kID) >> 24;
+}
+
+void SendICR(uint32_t apic_id, uint32_t command) {
+  if (x2apic_mode) {
+    // The ICR is a single 64-bit MSR, and delivery needs no polling. WRMSR
+    // to it is not serializing, so order earlier stores before the IPI.
+    __asm__ volatile("mfence" ::: "memory");
+    WriteMSR(kX2APICMSRBase + kICRLow / 16, (uint64_t{apic_id} << 32) | command);
+    return;
+  }
+
+  Write(kICRHigh, apic_id << 24);
+  Write(kICRLow, command);
+  while (Read(kICRLow) & kICRPending) {
+    __asm__ volatile("pause");
+  }
+}
+
+void Initialize() {
+  // xAPIC is kept unless firmware has enabled x2APIC already, which cannot
+  // be undone without disabling the LAPIC: the xHCI driver in usb/ reads the
+  // APIC ID for its MSI destination from the MMIO window.
+  if (ReadMSR(kIA32APICBase) & kAPICBaseX2APIC) {
+    EnableX2APIC();
+    x2apic_mode = true;
+  }
+  Log(kInfo, "LAPIC: %s mode\n", x2apic_mode ? "x2APIC" : "xAPIC");
+}
+
+void InitializeAP() {
+  if (x2apic_mode) {
+    EnableX2APIC();
+  }
+  Write(kSpuriousVector, (Read(kSpuriousVector) & ~0xffu) | 0x1ff);  // enable the LAPIC
+}
+
+} // namespace lapic
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+// Local APIC of the running CPU. In xAPIC mode its registers are reached
+// through the MMIO window at 0xfee00000; in x2APIC mode, which is used when
+// firmware has enabled it, through MSRs, which avoids uncached MMIO and
+// allows 32-bit APIC IDs.
+namespace lapic {
+
+// Registers by their xAPIC MMIO offset. The x2APIC MSR of a register is
+// 0x800 + offset / 16.
+enum Register : uint32_t {
+  kID = 0x020,
+  kEOI = 0x0b0,
+  kSpuriousVector = 0x0f0,
+  kICRLow = 0x300,
+  kICRHigh = 0x310,
+  kLVTTimer = 0x320,
+  kInitialCount = 0x380,
+  kCurrentCount = 0x390,
+  kDivideConfig = 0x3e0,
+};
+
+const uintptr_t kMMIOBase = 0xfee00000;
+const uint32_t kX2APICMSRBase = 0x800;
+
+extern bool x2apic_mode;
+
+inline uint32_t Read(Register reg) {
+  if (x2apic_mode) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(kX2APICMSRBase + reg / 16));
+    return lo;
+  }
+  return *reinterpret_cast<volatile uint32_t *>(kMMIOBase + reg);
+}
+
+inline void Write(Register reg, uint32_t value) {
+  if (x2apic_mode) {
+    __asm__ volatile("wrmsr"
+                     :: "c"(kX2APICMSRBase + reg / 16), "a"(value), "d"(0)
+                     : "memory");
+    return;
+  }
+  *reinterpret_cast<volatile uint32_t *>(kMMIOBase + reg) = value;
+}
+
+// APIC ID of the running CPU.
+uint32_t ID();
+
+// Sends an IPI with the ICR low word command to the CPU with the APIC ID,
+// and returns once it is delivered.
+void SendICR(uint32_t apic_id, uint32_t command);
+
+// Picks the LAPIC mode of the BSP: x2APIC if firmware enabled it, xAPIC
+// otherwise. Called before InitializePerCPU(0).
+void Initialize();
+
+// Puts an AP into the same mode as the BSP and enables its LAPIC.
+void InitializeAP();
+
+} // namespace lapic
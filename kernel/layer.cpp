@@ -93,6 +93,9 @@ void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
 
 void LayerManager::Move(unsigned int id, Vector2D<int> pos) {
   auto layer = FindLayer(id);
+  if (layer == nullptr) {
+    return;
+  }
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->Move(pos);
@@ -102,6 +105,9 @@ void LayerManager::Move(unsigned int id, Vector2D<int> pos) {
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
   auto layer = FindLayer(id);
+  if (layer == nullptr) {
+    return;
+  }
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->MoveRelative(pos_diff);
@@ -143,6 +149,24 @@ void LayerManager::Hide(unsigned int id) {
   }
 }
 
+void LayerManager::RemoveLayer(unsigned int id) {
+  auto layer = FindLayer(id);
+  if (layer == nullptr) {
+    return;
+  }
+
+  Rectangle<int> area{layer->GetPosition(), {0, 0}};
+  if (auto window = layer->GetWindow()) {
+    area.size = window->Size();
+  }
+
+  Hide(id);
+  auto it = std::find_if(layers_.begin(), layers_.end(),
+                         [layer](const auto &elem){ return elem.get() == layer; });
+  layers_.erase(it);
+  Draw(area);
+}
+
 Layer* LayerManager::FindLayer(unsigned int id) {
   auto pred = [id](const std::unique_ptr<Layer> &elem) {
     return elem->ID() == id;
@@ -228,6 +252,7 @@ void InitializeLayer() {
   layer_manager->UpDown(console->LayerID(), 1);
 
   active_layer = new ActiveLayer{*layer_manager};
+  layer_task_map = new std::map<unsigned int, uint64_t>;
 }
 
 void ProcessLayerMessage(const Message &msg) {
@@ -248,6 +273,28 @@ void ProcessLayerMessage(const Message &msg) {
   }
 }
 
+void CloseLayersOfTask(uint64_t task_id) {
+  std::vector<unsigned int> layer_ids;
+
+  layer_task_map_mutex.Lock();
+  for (auto it = layer_task_map->begin(); it != layer_task_map->end();) {
+    if (it->second == task_id) {
+      layer_ids.push_back(it->first);
+      it = layer_task_map->erase(it);
+    } else {
+      ++it;
+    }
+  }
+  layer_task_map_mutex.Unlock();
+
+  for (auto layer_id : layer_ids) {
+    if (active_layer->GetActive() == layer_id) {
+      active_layer->Activate(0);
+    }
+    layer_manager->RemoveLayer(layer_id);
+  }
+}
+
 ActiveLayer::ActiveLayer(LayerManager &manager) : manager_{manager} {}
 
 void ActiveLayer::SetMouseLayer(unsigned int mouse_layer) {
@@ -276,3 +323,8 @@ void ActiveLayer::Activate(unsigned int layer_id) {
 
 ActiveLayer *active_layer;
 std::map<unsigned int, uint64_t> *layer_task_map;
+
+namespace {
+  LockStats layer_task_map_lock_stats{"layer_task_map"};
+}
+Mutex layer_task_map_mutex{&layer_task_map_lock_stats};
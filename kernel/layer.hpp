@@ -6,6 +6,7 @@
 
 #include "graphics.hpp"
 #include "message.hpp"
+#include "sync.hpp"
 #include "window.hpp"
 
 class Layer {
@@ -47,6 +48,7 @@ class LayerManager {
 
   void UpDown(unsigned int id, int new_height);
   void Hide(unsigned int id);
+  void RemoveLayer(unsigned int id);
 
   Layer *FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
   Layer* FindLayer(unsigned int id);
@@ -77,9 +79,11 @@ class ActiveLayer {
 
 extern ActiveLayer *active_layer;
 extern std::map<unsigned int, uint64_t> *layer_task_map;
+extern Mutex layer_task_map_mutex;
 
 void InitializeLayer();
 void ProcessLayerMessage(const Message &msg);
+void CloseLayersOfTask(uint64_t task_id);
 
 constexpr Message MakeLayerMessage(
     uint64_t task_id, unsigned int layer_id,
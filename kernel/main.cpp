@@ -1,3 +1,4 @@
+#include <array>
 #include <cstdint>
 #include <cstddef>
 #include <cstdio>
@@ -13,8 +14,10 @@
 #include "font.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
+#include "hpet.hpp"
 #include "interrupt.hpp"
 #include "keyboard.hpp"
+#include "lapic.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
@@ -24,6 +27,8 @@
 #include "paging.hpp"
 #include "pci.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
+#include "softirq.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
@@ -105,7 +110,6 @@ void InputTextWindow(char c) {
     ++text_window_index;
     DrawTextCursor(true);
   }
-  layer_manager->Draw(text_window_layer_id);
 }
 
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
@@ -125,6 +129,8 @@ extern "C" void KernelMainNewStack(
   SetLogLevel(kWarn);
 
   InitializeSegmentation();
+  lapic::Initialize();
+  InitializePerCPU(0);
   InitializePaging();
   InitializeMemoryManager(memory_map);
   InitializeInterrupt();
@@ -135,17 +141,23 @@ extern "C" void KernelMainNewStack(
   layer_manager->Draw({{0, 0}, ScreenSize()});
 
   acpi::Initialize(acpi_table);
+  hpet::Initialize();
   InitializeLAPICTimer();
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer});
-  __asm__("sti");
+  // Cursor blinks need not be exact; the slack lets them share wakeups.
+  const unsigned long kCursorSlack = kTimer05Sec / 10;
+  // There is no current task to default to before InitializeTask(); the main
+  // task gets ID 1.
+  const uint64_t kMainTaskID = 1;
+  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, kMainTaskID, kCursorSlack});
   bool textbox_cursor_visible = false;
 
   InitializeTask();
   Task &main_task = task_manager->CurrentTask();
+  InitializeSMP();
+  InitializeSoftIRQ();
 
   fat::Initialize(volume_image);
   InitializePCI();
@@ -153,83 +165,97 @@ extern "C" void KernelMainNewStack(
   InitializeKeyboard();
   InitializeMouse();
 
-  const uint64_t task_terminal_id = task_manager->NewTask()
+  task_manager->NewTask()
       .InitContext(TaskTerminal, 0)
-      .Wakeup()
-      .ID();
+      .Wakeup();
 
   // Event loop
   char str[128];
+  std::array<Message, 32> msgs;
+  std::array<uint64_t, msgs.size()> key_irq_tscs;
+  bool reap_pending = false;
 
   while (1) {
-    __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
 
     sprintf(str, "%010lu", tick);
     FillRectangle(*main_window->InnerWriter(), {20, 4}, {80, 16}, {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
     layer_manager->Draw(main_window_layer_id);
 
-    __asm__("cli");
-    auto msg = main_task.ReceiveMessage();
-    if (!msg) {
-      main_task.Sleep();
-      __asm__("sti");
-      continue;
+    // Exited tasks that could not be reaped yet are retried on the next tick.
+    const auto events = main_task.Wait(Task::kEventMessage | Task::kEventIRQ,
+                                       reap_pending ? 1 : Task::kNoTimeout);
+    if (events & Task::kEventTimeout) {
+      reap_pending = task_manager->Reap();
     }
-
-    switch (msg->type) {
-    case Message::kInterruptXHCI:
+    if (events & Task::kEventIRQ) {
+      xhci_event_tsc = __atomic_exchange_n(&xhci_irq_tsc, 0, __ATOMIC_RELAXED);
       usb::xhci::ProcessEvents();
-      break;
-
-    case Message::kTimerTimeout:
-      if (msg->arg.timer.value == kTextboxCursorTimer) {
-        __asm__("cli");
-        timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer});
-        __asm__("sti");
-        textbox_cursor_visible = !textbox_cursor_visible;
-        DrawTextCursor(textbox_cursor_visible);
-        layer_manager->Draw(text_window_layer_id);
-
-        __asm__("cli");
-        task_manager->SendMessage(task_terminal_id, *msg);
-        __asm__("sti");
-      }
-      break;
+    }
 
-    case Message::kKeyPush:
-      if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
-        InputTextWindow(msg->arg.keyboard.ascii);
+    // Handle every pending message, then redraw once for the whole batch.
+    bool text_window_dirty = false;
+    size_t num_keys = 0;
+    const size_t num_msgs = main_task.ReceiveMessages(msgs.data(), msgs.size());
+    for (size_t i = 0; i < num_msgs; ++i) {
+      const Message *msg = &msgs[i];
+      switch (msg->type) {
+      case Message::kTimerTimeout:
+        if (msg->arg.timer.value == kTextboxCursorTimer) {
+          timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05Sec,
+                                        kTextboxCursorTimer, kMainTaskID, kCursorSlack});
+          textbox_cursor_visible = !textbox_cursor_visible;
+          DrawTextCursor(textbox_cursor_visible);
+          text_window_dirty = true;
+        }
+        break;
 
-      } else {
-        __asm__("cli");
-        auto task_it = layer_task_map->find(act);
-        __asm__("sti");
+      case Message::kKeyPush:
+        if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
+          InputTextWindow(msg->arg.keyboard.ascii);
+          text_window_dirty = true;
+          key_irq_tscs[num_keys++] = msg->arg.keyboard.irq_tsc;
 
-        if (task_it != layer_task_map->end()) {
-          __asm__("cli");
-          task_manager->SendMessage(task_it->second, *msg);
-          __asm__("sti");
         } else {
-          printk("key push not handled: keycode %02x, ascii %02x\n",
-              msg->arg.keyboard.keycode,
-              msg->arg.keyboard.ascii);
+          uint64_t task_id = 0;
+          layer_task_map_mutex.Lock();
+          if (auto it = layer_task_map->find(act); it != layer_task_map->end()) {
+            task_id = it->second;
+          }
+          layer_task_map_mutex.Unlock();
+
+          if (task_id != 0) {
+            task_manager->SendMessage(task_id, *msg);
+          } else {
+            printk("key push not handled: keycode %02x, ascii %02x\n",
+                msg->arg.keyboard.keycode,
+                msg->arg.keyboard.ascii);
+          }
         }
-      }
 
-      break;
+        break;
 
-    case Message::kLayer:
-      ProcessLayerMessage(*msg);
-      __asm__("cli");
-      task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-      __asm__("sti");
-      break;
+      case Message::kLayer:
+        ProcessLayerMessage(*msg);
+        task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
+        break;
 
-    default:
-      Log(kError, "Unknown message type: %d\n", msg->type);
+      case Message::kTaskExit:
+        CloseLayersOfTask(msg->src_task);
+        reap_pending = task_manager->Reap();
+        break;
+
+      default:
+        Log(kError, "Unknown message type: %d\n", msg->type);
+      }
+    }
+
+    if (text_window_dirty) {
+      layer_manager->Draw(text_window_layer_id);
+    }
+    for (size_t i = 0; i < num_keys; ++i) {
+      RecordKeyLatency(key_irq_tscs[i]);
     }
   }
 }
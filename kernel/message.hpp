@@ -6,11 +6,11 @@ enum class LayerOperation {
 
 struct Message {
   enum Type {
-    kInterruptXHCI,
     kTimerTimeout,
     kKeyPush,
     kLayer,
     kLayerFinish,
+    kTaskExit,
   } type;
 
   uint64_t src_task;
@@ -25,6 +25,7 @@ struct Message {
       uint8_t modifier;
       uint8_t keycode;
       char ascii;
+      uint64_t irq_tsc;
     } keyboard;
 
     struct {
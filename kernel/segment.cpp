@@ -55,3 +55,11 @@ void InitializeSegmentation() {
   SetDSAll(kKernelDS);
   SetCSSS(kKernelCS, kKernelSS);
 }
+
+// Loads the GDT built by the bootstrap processor on an application processor.
+// APs share the BSP's GDT. No CPU has a TSS.
+void InitializeSegmentationAP() {
+  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+  SetDSAll(kKernelDS);
+  SetCSSS(kKernelCS, kKernelSS);
+}
@@ -42,3 +42,4 @@ const uint16_t kKernelDS = 0;
 
 void SetupSegments();
 void InitializeSegmentation();
+void InitializeSegmentationAP();
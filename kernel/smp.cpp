@@ -0,0 +1,135 @@
+#include "smp.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  const uint32_t kICRInit = 0b101 << 8;
+  const uint32_t kICRStartup = 0b110 << 8;
+  const uint32_t kICRAssert = 1 << 14;
+
+  const size_t kAPStackBytes = 16 * 1024;
+
+  // Must match ApBootParams in asmfunc.asm.
+  struct APBootParams {
+    uint64_t cr0, cr3, cr4;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+  };
+
+  const uint32_t kIA32GSBase = 0xc0000101;
+
+  int ap_state;  // 1 once the AP is up, 2 once its idle task exists
+
+  void ApMain(uint64_t cpu) {
+    InitializeSegmentationAP();
+    lapic::InitializeAP();
+    InitializePerCPU(cpu);
+    InitializeInterruptAP();
+    InitializeLAPICTimerAP();
+
+    __atomic_store_n(&ap_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&ap_state, __ATOMIC_ACQUIRE) != 2) {
+      __asm__ volatile("pause");
+    }
+    task_manager->RunIdle(cpu);
+  }
+
+  bool WaitAPState(int state, unsigned long msec) {
+    for (unsigned long i = 0; i < msec; ++i) {
+      if (__atomic_load_n(&ap_state, __ATOMIC_ACQUIRE) == state) {
+        return true;
+      }
+      acpi::WaitMilliseconds(1);
+    }
+    return __atomic_load_n(&ap_state, __ATOMIC_ACQUIRE) == state;
+  }
+} // namespace
+
+std::array<PerCPU, kMaxCPUs> per_cpu;
+
+void InitializePerCPU(int cpu) {
+  PerCPU &p = per_cpu[cpu];
+  p.self = &p;
+  p.cpu = cpu;
+  p.apic_id = lapic::ID();
+  WriteMSR(kIA32GSBase, reinterpret_cast<uint64_t>(&p));
+}
+
+void SendIPI(int cpu, uint8_t vector) {
+  lapic::SendICR(per_cpu[cpu].apic_id, kICRAssert | vector);
+}
+
+// Starts every application processor listed in the MADT, one at a time.
+// Each comes up in ApMain() and runs its own idle task; it only runs tasks
+// whose affinity allows it.
+void InitializeSMP() {
+  const uint32_t bsp_id = per_cpu[0].apic_id;
+  if (acpi::madt == nullptr) {
+    Log(kWarn, "MADT is not found: running on one CPU\n");
+    return;
+  }
+
+  const auto frame = memory_manager->Allocate(1);
+  const uint64_t trampoline = reinterpret_cast<uint64_t>(frame.value.Frame());
+  if (frame.error || trampoline >= 0x100000) {
+    Log(kWarn, "no page below 1 MiB for the AP trampoline\n");
+    return;
+  }
+
+  memcpy(frame.value.Frame(), ApTrampoline, ApTrampolineEnd - ApTrampoline);
+  auto &params = *reinterpret_cast<APBootParams *>(
+      trampoline + (ApBootParams - ApTrampoline));
+  params.cr0 = GetCR0();
+  params.cr3 = GetCR3();
+  params.cr4 = GetCR4();
+  params.entry = reinterpret_cast<uint64_t>(ApMain);
+
+  int num_cpus = 1;
+  acpi::madt->ForEachLAPIC([&](uint32_t apic_id) {
+    if (apic_id == bsp_id || num_cpus == kMaxCPUs) {
+      return;
+    }
+    if (!lapic::x2apic_mode && apic_id > 0xff) {
+      Log(kWarn, "APIC ID %u needs x2APIC mode: CPU not started\n", apic_id);
+      return;
+    }
+
+    const int cpu = num_cpus;
+    auto stack = new uint64_t[kAPStackBytes / sizeof(uint64_t)];
+    params.stack = reinterpret_cast<uint64_t>(stack) + kAPStackBytes;
+    params.cpu = cpu;
+    __atomic_store_n(&ap_state, 0, __ATOMIC_RELEASE);
+
+    lapic::SendICR(apic_id, kICRInit | kICRAssert);
+    acpi::WaitMilliseconds(10);
+    for (int i = 0; i < 2; ++i) {
+      lapic::SendICR(apic_id, kICRStartup | kICRAssert | (trampoline >> 12));
+      if (WaitAPState(1, 1)) {
+        break;
+      }
+    }
+    if (!WaitAPState(1, 100)) {
+      // The stack is not freed: the CPU may still wake up and use it.
+      Log(kWarn, "CPU with APIC ID %u did not start\n", apic_id);
+      return;
+    }
+
+    task_manager->NewIdleTask(cpu);
+    __atomic_store_n(&ap_state, 2, __ATOMIC_RELEASE);
+    ++num_cpus;
+  });
+
+  Log(kInfo, "%d CPUs online\n", num_cpus);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+const int kMaxCPUs = 64;  // fits a uint64_t CPU mask
+
+class Task;
+
+// Data owned by one CPU, reached through the GS base of that CPU. Fields are
+// written only by their CPU, except current_task, which the scheduler also
+// sets while bringing up an application processor. There are no per-CPU
+// interrupt stacks: everything runs in ring 0 and no CPU has a TSS, so an
+// interrupt always stays on the stack of the task it interrupts.
+struct PerCPU {
+  PerCPU *self;  // at gs:0, so that the block's address is a single load
+  int cpu;
+  uint32_t apic_id;
+  Task *current_task;
+  uint64_t switches;  // context switches done on this CPU
+  uint64_t ticks;     // LAPIC timer interrupts taken on this CPU
+  uint32_t softirq_pending;  // bit n: softirq n is raised
+  bool in_softirq;
+  uint64_t irq_off_tsc;      // when interrupts were disabled, 0 if not tracked
+  const char *irq_off_site;  // function that disabled them
+};
+
+extern std::array<PerCPU, kMaxCPUs> per_cpu;
+
+inline PerCPU *ThisCPU() {
+  PerCPU *p;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(p));
+  return p;
+}
+
+// Index of the calling CPU: 0 for the bootstrap processor, then the
+// application processors in the order they were started. Call it with
+// interrupts disabled, or the caller may be migrated right afterwards.
+inline int CurrentCPU() {
+  int cpu;
+  __asm__ volatile("movl %%gs:%c1, %0" : "=r"(cpu) : "i"(offsetof(PerCPU, cpu)));
+  return cpu;
+}
+
+// Sets up the per-CPU block of the calling CPU and points its GS base at it.
+// Must run after the segment registers are loaded, since loading GS clears
+// the base.
+void InitializePerCPU(int cpu);
+void SendIPI(int cpu, uint8_t vector);
+void InitializeSMP();
@@ -0,0 +1,94 @@
+#include "softirq.hpp"
+
+#include <array>
+
+#include "smp.hpp"
+#include "sync.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  // Softirqs raised again while running are run again up to this many
+  // times; the rest is left to the worker task, so that a stream of
+  // interrupts cannot hold up the interrupted task for long.
+  const int kMaxSoftIRQRounds = 4;
+
+  void TimerSoftIRQ() {
+    timer_manager->Expire();
+  }
+
+  void XHCISoftIRQ() {
+    task_manager->Signal(1, Task::kEventIRQ);
+  }
+
+  void (*const softirq_handlers[kNumSoftIRQs])() = {
+    TimerSoftIRQ,
+    XHCISoftIRQ,
+  };
+
+  std::array<uint64_t, kMaxCPUs> worker_ids;  // 0 until the worker is started
+
+  void WakeWorker(int cpu) {
+    if (worker_ids[cpu] != 0) {
+      task_manager->Signal(worker_ids[cpu], Task::kEventWork);
+    }
+  }
+
+  void TaskWorker(uint64_t task_id, int64_t cpu) {
+    Task &task = task_manager->CurrentTask();
+    while (true) {
+      task.Wait(Task::kEventWork);
+
+      DisableInterrupts();
+      RunSoftIRQs();
+      EnableInterrupts();
+    }
+  }
+}
+
+void RaiseSoftIRQ(SoftIRQ n) {
+  __atomic_or_fetch(&ThisCPU()->softirq_pending, 1u << n, __ATOMIC_RELAXED);
+}
+
+bool RunSoftIRQs() {
+  // Interrupts that come in below do not switch tasks, so this stays on
+  // the same CPU and the same PerCPU.
+  PerCPU *p = ThisCPU();
+  if (p->in_softirq) {
+    return false;
+  }
+
+  p->in_softirq = true;
+  for (int round = 0; round < kMaxSoftIRQRounds; ++round) {
+    uint32_t pending = __atomic_exchange_n(&p->softirq_pending, 0, __ATOMIC_RELAXED);
+    if (pending == 0) {
+      break;
+    }
+    IRQOffEnd();
+    __asm__ volatile("sti" ::: "memory");
+    while (pending) {
+      softirq_handlers[__builtin_ctz(pending)]();
+      pending &= pending - 1;
+    }
+    __asm__ volatile("cli" ::: "memory");
+  }
+  p->in_softirq = false;
+
+  if (p->softirq_pending) {
+    WakeWorker(p->cpu);
+  }
+  return true;
+}
+
+void InitializeSoftIRQ() {
+  const uint64_t online = task_manager->OnlineCPUs();
+  for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+    if ((online & (uint64_t{1} << cpu)) == 0) {
+      continue;
+    }
+    Task &worker = task_manager->NewTask().InitContext(TaskWorker, cpu);
+    worker.SetAffinity(uint64_t{1} << cpu);
+    worker_ids[cpu] = worker.ID();
+    worker.Wakeup();
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+// Deferred interrupt work. An interrupt handler only acknowledges its source
+// and raises a softirq; pending softirqs run with interrupts enabled when the
+// handler returns, on the same CPU. Softirqs that keep being raised are left
+// to the worker task of the CPU.
+enum SoftIRQ {
+  kSoftIRQTimer,  // delivers the expired timers of timer_manager
+  kSoftIRQXHCI,   // wakes the main task to process xHCI events
+  kNumSoftIRQs,
+};
+
+// Marks the softirq pending on this CPU. Safe in interrupt handlers.
+void RaiseSoftIRQ(SoftIRQ n);
+
+// Runs the softirqs pending on this CPU. Called with interrupts disabled, at
+// the end of interrupt handlers after NotifyEndOfInterrupt(), and returns
+// with them disabled. Returns false if it interrupted softirq processing on
+// this CPU; the caller must not switch tasks then.
+bool RunSoftIRQs();
+
+// Starts a worker task on every online CPU. Called after InitializeSMP().
+void InitializeSoftIRQ();
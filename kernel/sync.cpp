@@ -0,0 +1,170 @@
+#include "sync.hpp"
+
+#include "asmfunc.h"
+#include "task.hpp"
+
+namespace {
+  void RegisterStats(LockStats *stats) {
+    if (__atomic_exchange_n(&stats->registered, true, __ATOMIC_RELAXED)) {
+      return;
+    }
+
+    LockStats *head = __atomic_load_n(&lock_stats_list, __ATOMIC_RELAXED);
+    do {
+      stats->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_stats_list, &head, stats, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  void RecordAcquire(LockStats *stats, uint64_t wait_start, uint64_t now) {
+    if (stats == nullptr) {
+      return;
+    }
+    if (!stats->registered) {
+      RegisterStats(stats);
+    }
+    ++stats->acquisitions;
+    if (wait_start != 0) {
+      ++stats->contentions;
+      stats->wait.Record(now - wait_start);
+    }
+  }
+
+  // Updated from every CPU without synchronization, like LockStats.
+  IRQOffStats irq_off_stats;
+} // namespace
+
+LockStats *lock_stats_list;
+
+void IRQOffBegin(const char *site) {
+  PerCPU *p = ThisCPU();
+  p->irq_off_tsc = ReadTSC();
+  p->irq_off_site = site;
+}
+
+// Interrupts may also be enabled by an sti that has no IRQOffBegin() before
+// it, e.g. on the return from an interrupt; irq_off_tsc is 0 then.
+void IRQOffEnd() {
+  PerCPU *p = ThisCPU();
+  if (p->irq_off_tsc == 0) {
+    return;
+  }
+  const uint64_t elapsed = ReadTSC() - p->irq_off_tsc;
+  p->irq_off_tsc = 0;
+  irq_off_stats.duration.Record(elapsed);
+  if (elapsed > irq_off_stats.max) {
+    irq_off_stats.max = elapsed;
+    irq_off_stats.max_site = p->irq_off_site;
+  }
+}
+
+IRQOffStats GetIRQOffStats() {
+  return irq_off_stats;
+}
+
+void SpinLock::Lock() {
+  const uint32_t ticket = __atomic_fetch_add(&next_ticket_, 1, __ATOMIC_RELAXED);
+
+  uint64_t wait_start = 0;
+  if (__atomic_load_n(&now_serving_, __ATOMIC_ACQUIRE) != ticket) {
+    wait_start = ReadTSC();
+    while (__atomic_load_n(&now_serving_, __ATOMIC_ACQUIRE) != ticket) {
+      __asm__ volatile("pause");
+    }
+  }
+
+  acquire_tsc_ = ReadTSC();
+  RecordAcquire(stats_, wait_start, acquire_tsc_);
+}
+
+void SpinLock::Unlock() {
+  if (stats_) {
+    stats_->hold.Record(ReadTSC() - acquire_tsc_);
+  }
+  __atomic_store_n(&now_serving_, now_serving_ + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t SpinLock::LockIRQSave(const char *site) {
+  const uint64_t flags = SaveAndDisableInterrupts(site);
+  Lock();
+  return flags;
+}
+
+void SpinLock::UnlockIRQRestore(uint64_t flags) {
+  Unlock();
+  RestoreInterrupts(flags);
+}
+
+void WaitQueue::Wait(SpinLock &lock) {
+  Task *task = &task_manager->CurrentTask();
+  task->wait_next_ = nullptr;
+  if (tail_) {
+    tail_->wait_next_ = task;
+  } else {
+    head_ = task;
+  }
+  tail_ = task;
+
+  task_manager->Sleep(task, lock);
+  lock.Lock();
+
+  // Another wakeup, e.g. a message, may have ended the sleep early.
+  Task **link = &head_;
+  Task *prev = nullptr;
+  while (*link && *link != task) {
+    prev = *link;
+    link = &prev->wait_next_;
+  }
+  if (*link) {
+    *link = task->wait_next_;
+    if (tail_ == task) {
+      tail_ = prev;
+    }
+    task->wait_next_ = nullptr;
+  }
+}
+
+void WaitQueue::WakeOne() {
+  Task *task = head_;
+  if (task == nullptr) {
+    return;
+  }
+  head_ = task->wait_next_;
+  if (head_ == nullptr) {
+    tail_ = nullptr;
+  }
+  task->wait_next_ = nullptr;
+  task_manager->Wakeup(task);
+}
+
+void WaitQueue::WakeAll() {
+  while (head_) {
+    WakeOne();
+  }
+}
+
+void Mutex::Lock() {
+  Task *task = &task_manager->CurrentTask();
+  SpinLockGuard guard{lock_};
+
+  uint64_t wait_start = 0;
+  if (owner_ != nullptr) {
+    wait_start = ReadTSC();
+    while (owner_ != nullptr) {
+      waiters_.Wait(lock_);
+    }
+  }
+
+  owner_ = task;
+  acquire_tsc_ = ReadTSC();
+  RecordAcquire(stats_, wait_start, acquire_tsc_);
+}
+
+void Mutex::Unlock() {
+  SpinLockGuard guard{lock_};
+  if (stats_) {
+    stats_->hold.Record(ReadTSC() - acquire_tsc_);
+  }
+  owner_ = nullptr;
+  waiters_.WakeOne();
+}
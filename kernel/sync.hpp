@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+
+#include "histogram.hpp"
+
+class Task;
+
+// Interrupts-off accounting. IRQOffBegin() is called right after interrupts
+// are disabled on a CPU, and IRQOffEnd() right before they are enabled again,
+// possibly by another task after a context switch. site names the function
+// that disabled them.
+void IRQOffBegin(const char *site);
+void IRQOffEnd();
+
+struct IRQOffStats {
+  Histogram duration;  // TSC cycles
+  uint64_t max;
+  const char *max_site;
+};
+
+IRQOffStats GetIRQOffStats();
+
+inline uint64_t SaveAndDisableInterrupts(const char *site = __builtin_FUNCTION()) {
+  uint64_t flags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+  if (flags & (1u << 9)) {  // IF
+    IRQOffBegin(site);
+  }
+  return flags;
+}
+
+inline void RestoreInterrupts(uint64_t flags) {
+  if (flags & (1u << 9)) {  // IF
+    IRQOffEnd();
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+// cli and sti for regions that do not nest.
+inline void DisableInterrupts(const char *site = __builtin_FUNCTION()) {
+  __asm__ volatile("cli" : : : "memory");
+  IRQOffBegin(site);
+}
+
+inline void EnableInterrupts() {
+  IRQOffEnd();
+  __asm__ volatile("sti" : : : "memory");
+}
+
+// Statistics shared by all locks of one kind, e.g. every task mailbox.
+// Updates from locks held on different CPUs are not synchronized, so the
+// numbers are approximate.
+struct LockStats {
+  constexpr LockStats(const char *name) : name{name} {}
+
+  const char *name;
+  uint64_t acquisitions{0};
+  uint64_t contentions{0};
+  Histogram hold{};  // TSC cycles from acquire to release
+  Histogram wait{};  // TSC cycles spent waiting, contended acquisitions only
+  LockStats *next{nullptr};
+  bool registered{false};
+};
+
+// Head of the list of every LockStats that has been acquired at least once.
+extern LockStats *lock_stats_list;
+
+// Ticket spinlock. Lock()/Unlock() expect interrupts to be disabled already;
+// use LockIRQSave()/UnlockIRQRestore() or SpinLockGuard otherwise, because an
+// interrupt handler taking the same lock on this CPU would never get it.
+class SpinLock {
+ public:
+  constexpr SpinLock(LockStats *stats = nullptr) : stats_{stats} {}
+  SpinLock(const SpinLock &) = delete;
+  SpinLock &operator=(const SpinLock &) = delete;
+
+  void Lock();
+  void Unlock();
+  uint64_t LockIRQSave(const char *site = __builtin_FUNCTION());
+  void UnlockIRQRestore(uint64_t flags);
+
+ private:
+  uint32_t next_ticket_{0};
+  uint32_t now_serving_{0};
+  uint64_t acquire_tsc_{0};
+  LockStats *stats_;
+};
+
+class SpinLockGuard {
+ public:
+  explicit SpinLockGuard(SpinLock &lock, const char *site = __builtin_FUNCTION())
+    : lock_{lock}, flags_{lock.LockIRQSave(site)} {}
+  ~SpinLockGuard() { lock_.UnlockIRQRestore(flags_); }
+  SpinLockGuard(const SpinLockGuard &) = delete;
+  SpinLockGuard &operator=(const SpinLockGuard &) = delete;
+
+ private:
+  SpinLock &lock_;
+  uint64_t flags_;
+};
+
+// Tasks sleeping until an event guarded by some SpinLock happens. Every
+// method must be called with that lock held, as with a condition variable.
+// Wakeups may be spurious, so waiters should recheck their condition.
+class WaitQueue {
+ public:
+  constexpr WaitQueue() = default;
+
+  // Sleeps the current task. The lock is released while sleeping and held
+  // again on return.
+  void Wait(SpinLock &lock);
+  void WakeOne();
+  void WakeAll();
+  bool Empty() const { return head_ == nullptr; }
+
+ private:
+  Task *head_{nullptr}, *tail_{nullptr};
+};
+
+// Sleeping lock for task context. Must not be used in interrupt handlers.
+class Mutex {
+ public:
+  constexpr Mutex(LockStats *stats = nullptr) : stats_{stats} {}
+  Mutex(const Mutex &) = delete;
+  Mutex &operator=(const Mutex &) = delete;
+
+  void Lock();
+  void Unlock();
+
+ private:
+  SpinLock lock_{};
+  WaitQueue waiters_{};
+  Task *owner_{nullptr};
+  uint64_t acquire_tsc_{0};
+  LockStats *stats_;
+};
+
+class MutexGuard {
+ public:
+  explicit MutexGuard(Mutex &mutex) : mutex_{mutex} { mutex_.Lock(); }
+  ~MutexGuard() { mutex_.Unlock(); }
+  MutexGuard(const MutexGuard &) = delete;
+  MutexGuard &operator=(const MutexGuard &) = delete;
+
+ private:
+  Mutex &mutex_;
+};
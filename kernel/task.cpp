@@ -1,23 +1,63 @@
 #include <algorithm>
 #include <cstring>
 #include "asmfunc.h"
+#include "interrupt.hpp"
+#include "ktime.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 #include "segment.hpp"
+#include "softirq.hpp"
 
 namespace {
-  template<class T, class U>
-  void Erase(T &c, const U &value) {
-    auto it = std::remove(c.begin(), c.end(), value);
-    c.erase(it, c.end());
+  LockStats scheduler_lock_stats{"scheduler"};
+  LockStats mailbox_lock_stats{"mailbox"};
+
+  // Deadline bandwidth is runtime / period in units of 1 / kBandwidthOne.
+  // Admission leaves a share of every CPU to the levels below.
+  const uint64_t kBandwidthOne = 1 << 20;
+  const uint64_t kMaxDeadlineBandwidth = kBandwidthOne * 95 / 100;
+
+  // Heap priority of a task in the treap of a sorted RunList. Task IDs are
+  // sequential; the multiplicative hash spreads them out.
+  uint32_t TreePriority(const Task *task) {
+    return (task->ID() * 0x9e3779b97f4a7c15ull) >> 32;
+  }
+
+  uint64_t CyclesPerTick() {
+    return ktime::TSCFrequency() / kTimerFreq;
+  }
+
+  // First code run by a new task. It is entered from Switch() with the
+  // scheduler lock held and interrupts disabled.
+  void TaskStart(uint64_t task_id, int64_t data, TaskFunc *f) {
+    task_manager->FinishSwitch();
+    EnableInterrupts();
+    f(task_id, data);
+    task_manager->CurrentTask().Exit();
   }
 
   void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+    while (true) {
+      DisableInterrupts();
+      if (task_manager->IsIdle()) {
+        EnterTicklessIdle();
+      }
+      // sti must stay right before hlt, so that no interrupt is missed.
+      IRQOffEnd();
+      __asm__ volatile("sti\n\thlt" ::: "memory");
+
+      DisableInterrupts();
+      ExitTicklessIdle();
+      RunSoftIRQs();
+      if (!task_manager->IsIdle()) {
+        task_manager->SwitchTask();
+      }
+      EnableInterrupts();
+    }
   }
 } // namespace
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {}
+Task::Task(uint64_t id) : id_{id}, msg_lock_{&mailbox_lock_stats}, msgs_{} {}
 
 Task &Task::InitContext(TaskFunc *f, int64_t data) {
   const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
@@ -26,14 +66,16 @@ Task &Task::InitContext(TaskFunc *f, int64_t data) {
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
-  context_.rflags = 0x202;
+  context_.rflags = 0x2;
   context_.cs = kKernelCS;
   context_.ss = kKernelSS;
   context_.rsp = (task_b_stack_end & ~0xflu) - 8;
+  *reinterpret_cast<uint64_t *>(context_.rsp) = 0;  // TaskStart never returns
 
-  context_.rip = reinterpret_cast<uint64_t>(f);
+  context_.rip = reinterpret_cast<uint64_t>(TaskStart);
   context_.rdi = id_;
   context_.rsi = data;
+  context_.rdx = reinterpret_cast<uint64_t>(f);
 
   *reinterpret_cast<uint32_t *>(&context_.fxsave_area[24]) = 0x1f80;
 
@@ -59,11 +101,100 @@ Task &Task::Wakeup() {
 }
 
 void Task::SendMessage(const Message &msg) {
-  msgs_.push_back(msg);
+  PushMessage(msg);
+  Wakeup();
+}
+
+void Task::Signal(uint32_t events) {
+  PostEvents(events);
   Wakeup();
 }
 
+void Task::PushMessage(const Message &msg) {
+  SpinLockGuard guard{msg_lock_};
+  msgs_.push_back(msg);
+}
+
+void Task::PostEvents(uint32_t events) {
+  SpinLockGuard guard{msg_lock_};
+  events_ |= events;
+}
+
+// Blocks until one of the given events is pending or the timeout (in ticks)
+// elapses, and returns the events that ended the wait. Events other than
+// kEventMessage are consumed. If no timer is left for the timeout, returns
+// kEventTimeout at once.
+uint32_t Task::Wait(uint32_t events, unsigned long timeout) {
+  SpinLockGuard guard{msg_lock_};
+  return WaitEvents(events, timeout);
+}
+
+// Must be called on the current task with msg_lock_ held. A timed wait arms
+// a single timer that wakes this task at the deadline.
+uint32_t Task::WaitEvents(uint32_t events, unsigned long timeout) {
+  const auto deadline = timeout == kNoTimeout
+    ? kNoTimeout : timer_manager->CurrentTick() + timeout;
+
+  uint32_t ready;
+  while (true) {
+    ready = events_ & events;
+    if ((events & kEventMessage) && !msgs_.empty()) {
+      ready |= kEventMessage;
+    }
+    if (ready) {
+      break;
+    }
+
+    if (deadline != kNoTimeout) {
+      if (timer_manager->CurrentTick() >= deadline) {
+        ready = kEventTimeout;
+        break;
+      }
+      if (wait_deadline_ != deadline) {
+        const auto timer = timer_manager->AddTimer(Timer{deadline, kWaitTimerValue, id_});
+        if (timer.error) {
+          // Nothing would end the sleep at the deadline.
+          ready = kEventTimeout;
+          break;
+        }
+        wait_deadline_ = deadline;
+        wait_timer_ = timer.value;
+      }
+    }
+
+    task_manager->Sleep(this, msg_lock_);
+    msg_lock_.Lock();
+  }
+
+  if (wait_timer_ != 0) {
+    timer_manager->CancelTimer(wait_timer_);
+    wait_timer_ = 0;
+  }
+  wait_deadline_ = 0;
+  events_ &= ~ready;
+  return ready;
+}
+
+void Task::Exit() {
+  task_manager->Exit(this);
+}
+
 std::optional<Message> Task::ReceiveMessage() {
+  SpinLockGuard guard{msg_lock_};
+  return PopMessage();
+}
+
+// Moves up to n pending messages into buf under a single lock acquisition
+// and returns how many were moved.
+size_t Task::ReceiveMessages(Message *buf, size_t n) {
+  SpinLockGuard guard{msg_lock_};
+  const size_t count = std::min(n, msgs_.size());
+  std::copy_n(msgs_.begin(), count, buf);
+  msgs_.erase(msgs_.begin(), msgs_.begin() + count);
+  return count;
+}
+
+std::optional<Message> Task::PopMessage() {
   if (msgs_.empty()) {
     return std::nullopt;
   }
@@ -72,144 +203,849 @@ std::optional<Message> Task::ReceiveMessage() {
   return m;
 }
 
-TaskManager::TaskManager() {
-  Task &task = NewTask().SetLevel(current_level_).SetRunning(true);
-  running_[current_level_].push_back(&task);
+void RunList::PushBack(Task *task) {
+  task->run_prev_ = tail_;
+  task->run_next_ = nullptr;
+  if (tail_) {
+    tail_->run_next_ = task;
+  } else {
+    head_ = task;
+  }
+  tail_ = task;
+}
+
+void RunList::InsertByVruntime(Task *task) {
+  InsertSorted(task, task->vruntime_);
+}
+
+void RunList::InsertByDeadline(Task *task) {
+  InsertSorted(task, task->dl_abs_deadline_);
+}
+
+// Ties go behind existing tasks. The task is added to the treap as a leaf
+// and rotated up to its place in the heap order.
+void RunList::InsertSorted(Task *task, uint64_t key) {
+  task->run_key_ = key;
+  task->tree_left_ = task->tree_right_ = nullptr;
+
+  Task *parent = nullptr, *prev = nullptr;
+  Task **link = &root_;
+  while (*link) {
+    parent = *link;
+    if (parent->run_key_ <= key) {
+      prev = parent;
+      link = &parent->tree_right_;
+    } else {
+      link = &parent->tree_left_;
+    }
+  }
+  *link = task;
+  task->tree_parent_ = parent;
+  InsertAfter(prev, task);
+
+  while (task->tree_parent_ && TreePriority(task->tree_parent_) < TreePriority(task)) {
+    RotateUp(task);
+  }
+}
+
+// Moves the task above its parent, keeping the in-order sequence.
+void RunList::RotateUp(Task *task) {
+  Task *parent = task->tree_parent_;
+  Task *grandparent = parent->tree_parent_;
+  if (parent->tree_left_ == task) {
+    parent->tree_left_ = task->tree_right_;
+    if (task->tree_right_) {
+      task->tree_right_->tree_parent_ = parent;
+    }
+    task->tree_right_ = parent;
+  } else {
+    parent->tree_right_ = task->tree_left_;
+    if (task->tree_left_) {
+      task->tree_left_->tree_parent_ = parent;
+    }
+    task->tree_left_ = parent;
+  }
+  parent->tree_parent_ = task;
+
+  task->tree_parent_ = grandparent;
+  if (grandparent == nullptr) {
+    root_ = task;
+  } else if (grandparent->tree_left_ == parent) {
+    grandparent->tree_left_ = task;
+  } else {
+    grandparent->tree_right_ = task;
+  }
+}
+
+// Rotates the task down until it has at most one child, then splices it out.
+void RunList::TreeRemove(Task *task) {
+  while (task->tree_left_ && task->tree_right_) {
+    RotateUp(TreePriority(task->tree_left_) > TreePriority(task->tree_right_)
+             ? task->tree_left_ : task->tree_right_);
+  }
+
+  Task *child = task->tree_left_ ? task->tree_left_ : task->tree_right_;
+  Task *parent = task->tree_parent_;
+  if (child) {
+    child->tree_parent_ = parent;
+  }
+  if (parent == nullptr) {
+    root_ = child;
+  } else if (parent->tree_left_ == task) {
+    parent->tree_left_ = child;
+  } else {
+    parent->tree_right_ = child;
+  }
+  task->tree_parent_ = task->tree_left_ = task->tree_right_ = nullptr;
+}
+
+// Inserts the task after prev, or at the head if prev is null.
+void RunList::InsertAfter(Task *prev, Task *task) {
+  task->run_prev_ = prev;
+  task->run_next_ = prev ? prev->run_next_ : head_;
+  if (task->run_next_) {
+    task->run_next_->run_prev_ = task;
+  } else {
+    tail_ = task;
+  }
+  if (prev) {
+    prev->run_next_ = task;
+  } else {
+    head_ = task;
+  }
+}
+
+void RunList::Remove(Task *task) {
+  if (root_) {
+    TreeRemove(task);
+  }
+  if (task->run_prev_) {
+    task->run_prev_->run_next_ = task->run_next_;
+  } else {
+    head_ = task->run_next_;
+  }
+  if (task->run_next_) {
+    task->run_next_->run_prev_ = task->run_prev_;
+  } else {
+    tail_ = task->run_prev_;
+  }
+  task->run_prev_ = task->run_next_ = nullptr;
+}
+
+TaskManager::TaskManager() : lock_{&scheduler_lock_stats} {
+  level_slice_.fill(kTaskTimerPeriod);
+
+  Task &task = NewTask().SetLevel(kMaxLevel).SetRunning(true);
+  Enqueue(&task, kMaxLevel);
+  task.dispatch_tsc_ = ReadTSC();
+  cpus_[0].current = &task;
+  per_cpu[0].current_task = &task;
 
   Task &idle = NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
-  running_[0].push_back(&idle);
+  Enqueue(&idle, 0);
+  cpus_[0].idle = &idle;
 }
 
 Task &TaskManager::NewTask() {
-  ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  SpinLockGuard guard{lock_};
+  uint64_t id;
+  if (free_ids_.empty()) {
+    id = ++latest_id_;
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+  return *tasks_.emplace_back(new Task{id});
 }
 
-void TaskManager::SwitchTask(bool current_sleep) {
-  auto &level_queue = running_[current_level_];
-  Task *current_task = level_queue.front();
-  level_queue.pop_front();
+// Creates the idle task of an application processor. Called on the BSP
+// while the AP waits in ApMain(); the AP then turns its boot stack into
+// that task with RunIdle().
+void TaskManager::NewIdleTask(int cpu) {
+  Task &idle = NewTask().SetLevel(0).SetRunning(true);
 
-  if (!current_sleep) {
-    level_queue.push_back(current_task);
-  }
+  SpinLockGuard guard{lock_};
+  idle.cpu_ = cpu;
+  idle.affinity_ = uint64_t{1} << cpu;
+  Enqueue(&idle, 0);
+  cpus_[cpu].idle = cpus_[cpu].current = &idle;
+  per_cpu[cpu].current_task = &idle;
+}
 
-  if (level_queue.empty()) {
-    level_changed_ = true;
+void TaskManager::RunIdle(int cpu) {
+  Task *idle;
+  {
+    SpinLockGuard guard{lock_};
+    idle = cpus_[cpu].idle;
+    idle->dispatch_tsc_ = ReadTSC();
+    online_cpus_ |= uint64_t{1} << cpu;
   }
+  TaskIdle(idle->ID(), 0);
+}
 
-  if (level_changed_) {
-    level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
-        break;
-      }
+void TaskManager::SwitchTask() {
+  ExitTicklessIdle();
+  SpinLockGuard guard{lock_};
+  Switch(false);
+}
+
+// Called by a new task on its first dispatch, in place of returning from
+// SwitchContext() in Switch().
+void TaskManager::FinishSwitch() {
+  lock_.Unlock();
+}
+
+void TaskManager::Switch(bool current_sleep) {
+  const int cpu = CurrentCPU();
+  auto &rq = cpus_[cpu];
+  Task *current_task = rq.current;
+  rq.need_resched = false;
+
+  const uint64_t now = ReadTSC();
+  rq.switch_start_tsc = now;
+  ChargeSlice(current_task, now);
+  if (current_task->dl_runtime_ != 0) {
+    ChargeDeadline(current_task, now);
+  }
+  // A task put to sleep from another CPU is already off the run queue.
+  if (!current_sleep && current_task->Running() && !current_task->dl_throttled_) {
+    // The task may leave this CPU here if its affinity no longer allows it.
+    Dequeue(current_task);
+    MoveToCPU(current_task, SelectCPU(current_task));
+    Enqueue(current_task, current_task->Level());
+    if (current_task->cpu_ != cpu) {
+      CheckPreempt(current_task);
     }
   }
 
-  Task *next_task = running_[current_level_].front();
-  SwitchContext(&next_task->Context(), &current_task->Context());
+  if ((rq.ready_levels >> 1) == 0) {
+    PullTask(cpu);
+  }
+
+  // The idle task never sleeps, so at least level 0 is always ready.
+  const int next_level = 63 - __builtin_clzll(rq.ready_levels);
+  Task *next_task = rq.running[next_level].Front();
+  rq.current = next_task;
+  PerCPU *this_cpu = ThisCPU();
+  this_cpu->current_task = next_task;
+  if (next_task != current_task) {
+    ++next_task->switches_;
+    ++this_cpu->switches;
+  }
+
+  Dispatch(next_task, now);
+  SwitchContextFast(&next_task->Context(), &current_task->Context());
+  switch_cost_.Record(ReadTSC() - cpus_[CurrentCPU()].switch_start_tsc);
 }
 
 void TaskManager::Sleep(Task *task) {
+  SpinLockGuard guard{lock_};
+  SleepLocked(task);
+}
+
+// Puts the task to sleep and releases the lock, which the caller holds with
+// interrupts disabled. The scheduler lock is taken first, so a wakeup issued
+// under that lock cannot slip in before the task is off the run queue.
+void TaskManager::Sleep(Task *task, SpinLock &lock) {
+  lock_.Lock();
+  lock.Unlock();
+  SleepLocked(task);
+  lock_.Unlock();
+}
+
+Error TaskManager::Sleep(uint64_t id) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task == nullptr) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+  SleepLocked(task);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// A task sleeping while it runs on another CPU stops at that CPU's next
+// switch, which is forced right away.
+void TaskManager::SleepLocked(Task *task) {
   if (!task->Running()) {
     return;
   }
 
   task->SetRunning(false);
+  if (task->dl_throttled_) {
+    task->dl_throttled_ = false;
+  } else {
+    Dequeue(task);
+  }
 
-  if (task == running_[current_level_].front()) {
-    SwitchTask(true);
-    return;
+  const int cpu = CurrentCPU();
+  if (task == cpus_[cpu].current) {
+    Switch(true);
+  } else if (task == cpus_[task->cpu_].current) {
+    cpus_[task->cpu_].need_resched = true;
+    SendIPI(task->cpu_, InterruptVector::kReschedule);
   }
+}
 
-  Erase(running_[task->Level()], task);
+void TaskManager::Wakeup(Task *task, int level) {
+  SpinLockGuard guard{lock_};
+  WakeupLocked(task, level);
 }
 
-Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+Error TaskManager::Wakeup(uint64_t id, int level) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
-  Sleep(it->get());
+  WakeupLocked(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::Wakeup(Task *task, int level) {
+void TaskManager::WakeupLocked(Task *task, int level) {
+  if (task->exited_) {
+    return;
+  }
+
   if (task->Running()) {
     ChangeLevelRunning(task, level);
     return;
   }
 
-  if (level < 0) {
+  if (level < 0 || level == kDeadlineLevel || task->dl_runtime_ != 0) {
     level = task->Level();
   }
 
   task->SetLevel(level);
   task->SetRunning(true);
 
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+  task->wakeup_tsc_ = ReadTSC();
+  ++task->wakeups_;
+  // A task that is still being switched out after a remote Sleep() stays on
+  // its CPU, so that no other CPU can pick it before its context is saved.
+  if (!OnCPU(task)) {
+    MoveToCPU(task, SelectCPU(task));
   }
-  return;
+
+  if (task->dl_runtime_ != 0) {
+    // Keep the current deadline only if the remaining budget fits in it at
+    // the reserved bandwidth; otherwise the task would overrun its share.
+    const unsigned long tick = timer_manager->CurrentTick();
+    if (tick >= task->dl_abs_deadline_ ||
+        static_cast<unsigned __int128>(task->dl_budget_) * task->dl_period_ >
+        static_cast<unsigned __int128>(task->dl_abs_deadline_ - tick) *
+        task->dl_runtime_ * CyclesPerTick()) {
+      StartDeadlinePeriod(task, tick);
+    } else if (task->dl_budget_ == 0) {
+      Throttle(task);
+      return;
+    }
+  }
+
+  Enqueue(task, level);
+  CheckPreempt(task);
 }
 
-Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+void TaskManager::ChangeLevelRunning(Task *task, int level) {
+  if (level < 0 || level == task->Level() ||
+      level == kDeadlineLevel || task->dl_runtime_ != 0) {
+    return;
+  }
+
+  Dequeue(task);
+  task->SetLevel(level);
+  Enqueue(task, level);
+  CheckPreempt(task);
+}
+
+Error Task::SetDeadline(unsigned long runtime, unsigned long deadline, unsigned long period) {
+  return task_manager->SetDeadline(this, runtime, deadline, period);
+}
+
+// Reserves runtime ticks in every period ticks, to be used within deadline
+// ticks of the period start, for the task on its current CPU. The task then
+// runs in kDeadlineLevel and stays on that CPU. A runtime of 0 cancels the
+// reservation and moves the task back to the fair level.
+Error TaskManager::SetDeadline(Task *task, unsigned long runtime,
+                               unsigned long deadline, unsigned long period) {
+  SpinLockGuard guard{lock_};
+  return SetDeadlineLocked(task, runtime, deadline, period);
+}
+
+Error TaskManager::SetDeadline(uint64_t id, unsigned long runtime,
+                               unsigned long deadline, unsigned long period) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
-  Wakeup(it->get(), level);
+  return SetDeadlineLocked(task, runtime, deadline, period);
+}
+
+Error TaskManager::SetDeadlineLocked(Task *task, unsigned long runtime,
+                                     unsigned long deadline, unsigned long period) {
+  auto &rq = cpus_[task->cpu_];
+  if (task == rq.idle || task->exited_) {
+    return MAKE_ERROR(Error::kInvalidDeadline);
+  }
+
+  uint64_t bandwidth = 0;
+  if (runtime != 0) {
+    if (runtime > deadline || deadline > period) {
+      return MAKE_ERROR(Error::kInvalidDeadline);
+    }
+    bandwidth = runtime * kBandwidthOne / period;
+    if (rq.dl_bandwidth - task->dl_bandwidth_ + bandwidth > kMaxDeadlineBandwidth) {
+      return MAKE_ERROR(Error::kOvercommit);
+    }
+  }
+  rq.dl_bandwidth = rq.dl_bandwidth - task->dl_bandwidth_ + bandwidth;
+  task->dl_bandwidth_ = bandwidth;
+
+  const bool queued = task->Running() && !task->dl_throttled_;
+  if (queued) {
+    Dequeue(task);
+  }
+  task->dl_throttled_ = false;
+  task->dl_runtime_ = runtime;
+  task->dl_deadline_ = deadline;
+  task->dl_period_ = period;
+  task->SetLevel(runtime != 0 ? kDeadlineLevel : kFairLevel);
+  if (runtime != 0) {
+    StartDeadlinePeriod(task, timer_manager->CurrentTick());
+  }
+
+  if (task->Running()) {
+    Enqueue(task, task->Level());
+    CheckPreempt(task);
+    if (task == rq.current) {
+      rq.need_resched = true;
+    }
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::ChangeLevelRunning(Task *task, int level) {
-  if (level < 0 || level == task->Level()) {
+// Called by the timer armed in Throttle() at the start of the next period.
+void TaskManager::ReplenishDeadline(uint64_t id, unsigned long tick) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task == nullptr || !task->dl_throttled_ || task->dl_replenish_tick_ != tick) {
+    return;
+  }
+
+  task->dl_throttled_ = false;
+  StartDeadlinePeriod(task, tick);
+  Enqueue(task, task->Level());
+  CheckPreempt(task);
+}
+
+void TaskManager::StartDeadlinePeriod(Task *task, unsigned long start) {
+  task->dl_abs_deadline_ = start + task->dl_deadline_;
+  task->dl_budget_ = task->dl_runtime_ * CyclesPerTick();
+}
+
+// Budget is charged in TSC cycles of the CPU the task ran on. The time slice
+// of a deadline task ends at the first tick after its budget runs out.
+void TaskManager::ChargeDeadline(Task *task, uint64_t now) {
+  const uint64_t used = now - task->dispatch_tsc_;
+  task->dl_budget_ -= std::min(task->dl_budget_, used);
+  if (task->dl_budget_ == 0 && task->Running()) {
+    Dequeue(task);
+    Throttle(task);
+  }
+}
+
+// Keeps a runnable task that has used up its budget off the run queue until
+// its next period starts.
+void TaskManager::Throttle(Task *task) {
+  task->dl_throttled_ = true;
+  task->dl_replenish_tick_ = std::max(
+      task->dl_abs_deadline_ - task->dl_deadline_ + task->dl_period_,
+      timer_manager->CurrentTick() + 1);
+  timer_manager->AddTimer(Timer{task->dl_replenish_tick_, kDeadlineTimerValue, task->id_});
+}
+
+Error Task::SetAffinity(uint64_t cpu_mask) {
+  return task_manager->SetAffinity(this, cpu_mask);
+}
+
+// A queued task moves to an allowed CPU at once. A task running on a CPU
+// it may no longer use moves at that CPU's next switch, which is forced
+// right away.
+Error TaskManager::SetAffinity(Task *task, uint64_t cpu_mask) {
+  SpinLockGuard guard{lock_};
+  if ((cpu_mask & online_cpus_) == 0 || task == cpus_[task->cpu_].idle ||
+      task->dl_runtime_ != 0) {
+    return MAKE_ERROR(Error::kInvalidAffinity);
+  }
+
+  task->affinity_ = cpu_mask;
+  const int cpu = task->cpu_;
+  if (!task->Running() || ((cpu_mask >> cpu) & 1)) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  if (task != cpus_[cpu].current) {
+    Migrate(task, SelectCPU(task));
+  } else if (cpu == CurrentCPU()) {
+    Switch(false);
+  } else {
+    cpus_[cpu].need_resched = true;
+    SendIPI(cpu, InterruptVector::kReschedule);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+uint64_t TaskManager::OnlineCPUs() {
+  SpinLockGuard guard{lock_};
+  return online_cpus_;
+}
+
+// Prefers the CPU the task last ran on, so that its cache stays warm.
+// Deadline tasks stay on the CPU their bandwidth was admitted on.
+int TaskManager::SelectCPU(const Task *task) const {
+  const uint64_t allowed = task->affinity_ & online_cpus_;
+  if (allowed == 0 || ((allowed >> task->cpu_) & 1) || task->dl_runtime_ != 0) {
+    return task->cpu_;
+  }
+  return __builtin_ctzll(allowed);
+}
+
+// Rebases the virtual runtime of a task that is on no run queue onto the
+// given CPU.
+void TaskManager::MoveToCPU(Task *task, int cpu) {
+  const int from = task->cpu_;
+  if (from == cpu) {
     return;
   }
+  const uint64_t lag = task->vruntime_ - std::min(task->vruntime_, cpus_[from].min_vruntime);
+  task->vruntime_ = cpus_[cpu].min_vruntime + lag;
+  task->cpu_ = cpu;
+}
 
-  if (task != running_[current_level_].front()) {
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
-    task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+// Moves a queued task that is not running on any CPU to the given CPU.
+void TaskManager::Migrate(Task *task, int cpu) {
+  Dequeue(task);
+  MoveToCPU(task, cpu);
+  Enqueue(task, task->Level());
+  CheckPreempt(task);
+}
+
+// Returns the highest-level task that waits on another CPU's run queue and
+// may run on the given CPU.
+Task *TaskManager::FindPullable(int cpu) {
+  Task *found = nullptr;
+  for (int c = 0; c < kMaxCPUs; ++c) {
+    if (c == cpu || ((online_cpus_ >> c) & 1) == 0) {
+      continue;
     }
+
+    const auto &rq = cpus_[c];
+    for (uint64_t levels = rq.ready_levels & ~uint64_t{1}; levels; ) {
+      const int level = 63 - __builtin_clzll(levels);
+      levels &= ~(uint64_t{1} << level);
+      if (found && level <= found->Level()) {
+        break;
+      }
+      for (Task *task = rq.running[level].Front(); task; task = task->run_next_) {
+        if (task != rq.current && task->dl_runtime_ == 0 &&
+            ((task->affinity_ >> cpu) & 1)) {
+          found = task;
+          break;
+        }
+      }
+    }
+  }
+  return found;
+}
+
+// Called by a CPU that has nothing but its idle task to run.
+void TaskManager::PullTask(int cpu) {
+  if (Task *task = FindPullable(cpu)) {
+    Dequeue(task);
+    MoveToCPU(task, cpu);
+    Enqueue(task, task->Level());
+  }
+}
+
+// Requests a switch on the task's CPU if the task should run ahead of the
+// current one there.
+void TaskManager::CheckPreempt(const Task *task) {
+  const int cpu = task->cpu_;
+  auto &rq = cpus_[cpu];
+  const Task *current = rq.current;
+  const bool earlier_deadline = task->Level() == kDeadlineLevel &&
+    current->Level() == kDeadlineLevel &&
+    task->dl_abs_deadline_ < current->dl_abs_deadline_;
+  if (task->Level() <= current->Level() && !earlier_deadline) {
     return;
   }
+  rq.need_resched = true;
+  if (cpu != CurrentCPU()) {
+    SendIPI(cpu, InterruptVector::kReschedule);
+  }
+}
 
-  running_[current_level_].pop_front();
-  running_[level].push_back(task);
-  task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
-  } else {
-    current_level_ = level;
-    level_changed_ = true;
+bool TaskManager::OnCPU(const Task *task) const {
+  for (int c = 0; c < kMaxCPUs; ++c) {
+    if (((online_cpus_ >> c) & 1) && cpus_[c].current == task) {
+      return true;
+    }
   }
+  return false;
 }
 
 TaskManager *task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
-  __asm__("sti");
 }
 
+// A single gs-relative load, so the result is the caller's task even if it
+// is migrated right afterwards.
 Task &TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  Task *task;
+  __asm__ volatile("mov %%gs:%c1, %0"
+                   : "=r"(task) : "i"(offsetof(PerCPU, current_task)));
+  return *task;
 }
 
-Error TaskManager::SendMessage(uint64_t id, const Message &msg) {
+// Keeps the task from being reaped while it is used without the scheduler
+// lock, e.g. under its mailbox lock, which must be taken first.
+Task *TaskManager::PinTask(uint64_t id) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task) {
+    ++task->pins_;
+  }
+  return task;
+}
+
+void TaskManager::UnpinTask(Task *task) {
+  SpinLockGuard guard{lock_};
+  --task->pins_;
+}
+
+void TaskManager::WakeupAndUnpin(Task *task) {
+  SpinLockGuard guard{lock_};
+  WakeupLocked(task, -1);
+  --task->pins_;
+}
+
+Task *TaskManager::FindTaskLocked(uint64_t id) {
   auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto &t){ return t->ID() == id; });
   if (it == tasks_.end()) {
+    return nullptr;
+  }
+  return it->get();
+}
+
+// Takes the task off the run queues for good. Its stack, mailbox and ID are
+// released by Reap(), which runs on the main task after this task has been
+// switched out. Does not return if the task is the current one.
+void TaskManager::Exit(Task *task) {
+  // Interrupts stay disabled until the task is switched out, so that the main
+  // task cannot reap it while it still runs on this CPU.
+  const uint64_t flags = SaveAndDisableInterrupts();
+
+  lock_.Lock();
+  const bool exit = !task->exited_ && task->ID() != 1 && task != cpus_[task->cpu_].idle;
+  if (exit) {
+    task->exited_ = true;
+    cpus_[task->cpu_].dl_bandwidth -= task->dl_bandwidth_;
+    task->dl_bandwidth_ = 0;
+    zombies_.push_back(task);
+  }
+  lock_.Unlock();
+
+  if (exit) {
+    // Expiries would go to a task that no longer reads its mailbox, or to a
+    // later task that reuses its ID.
+    timer_manager->CancelTimers(task->ID());
+    SendMessage(1, Message{Message::kTaskExit, task->ID()});
+    Sleep(task);
+  }
+  RestoreInterrupts(flags);
+}
+
+// An exiting task on another CPU may not have been switched out yet, and a
+// pinned one is still in use. Such tasks are left for a later call; returns
+// true if there are any.
+bool TaskManager::Reap() {
+  // Destroyed after the lock is released.
+  std::vector<std::unique_ptr<Task>> reaped;
+
+  SpinLockGuard guard{lock_};
+  const auto busy = std::partition(zombies_.begin(), zombies_.end(),
+      [this](const Task *task){
+        return !task->Running() && !OnCPU(task) && task->pins_ == 0;
+      });
+  for (auto z = zombies_.begin(); z != busy; ++z) {
+    Task *task = *z;
+    free_ids_.push_back(task->ID());
+    auto it = std::find_if(tasks_.begin(), tasks_.end(), [task](const auto &t){ return t.get() == task; });
+    reaped.push_back(std::move(*it));
+    tasks_.erase(it);
+  }
+  zombies_.erase(zombies_.begin(), busy);
+  return !zombies_.empty();
+}
+
+// True if this CPU has nothing to run but its idle task, even by pulling
+// from another CPU.
+bool TaskManager::IsIdle() {
+  SpinLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  return (cpus_[cpu].ready_levels >> 1) == 0 && FindPullable(cpu) == nullptr;
+}
+
+// Called on the way out of an interrupt handler, after EOI, so that a task
+// woken by the interrupt preempts a lower-level task right away instead of
+// waiting for the next task timer.
+void TaskManager::ReschedIfNeeded() {
+  if (cpus_[CurrentCPU()].need_resched) {
+    SwitchTask();
+  }
+}
+
+bool TaskManager::SliceExpired() const {
+  const auto &rq = cpus_[CurrentCPU()];
+  return rq.current != rq.idle && ReadTSC() >= rq.slice_end;
+}
+
+// Tasks running right now are charged for the part of their time slice that
+// has elapsed so far.
+std::vector<TaskUsage> TaskManager::Usage() {
+  SpinLockGuard guard{lock_};
+  const uint64_t now = ReadTSC();
+
+  std::vector<TaskUsage> usage;
+  usage.reserve(tasks_.size());
+  for (const auto &task : tasks_) {
+    uint64_t cpu_cycles = task->cpu_cycles_;
+    if (OnCPU(task.get())) {
+      cpu_cycles += now - task->dispatch_tsc_;
+    }
+    usage.push_back({task->id_, task->cpu_, task->Level(), task->Running(),
+                     cpu_cycles, task->switches_, task->wakeups_});
+  }
+
+  std::sort(usage.begin(), usage.end(),
+            [](const auto &a, const auto &b){ return a.id < b.id; });
+  return usage;
+}
+
+std::optional<SchedStats> TaskManager::TaskStats(uint64_t id) {
+  SpinLockGuard guard{lock_};
+  Task *task = FindTaskLocked(id);
+  if (task == nullptr) {
+    return std::nullopt;
+  }
+  return task->stats_;
+}
+
+SchedStats TaskManager::LevelStats(int level) {
+  SpinLockGuard guard{lock_};
+  return level_stats_[level];
+}
+
+Histogram TaskManager::SwitchCost() {
+  SpinLockGuard guard{lock_};
+  return switch_cost_;
+}
+
+// The scheduler lock is taken twice, to find the task and to wake it. The
+// mailbox lock comes before it in the lock order, so the message is pushed
+// in between, with the task pinned.
+Error TaskManager::SendMessage(uint64_t id, const Message &msg) {
+  Task *task = PinTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
-  (*it)->SendMessage(msg);
+  task->PushMessage(msg);
+  WakeupAndUnpin(task);
   return MAKE_ERROR(Error::kSuccess);
 }
+
+Error TaskManager::Signal(uint64_t id, uint32_t events) {
+  Task *task = PinTask(id);
+  if (task == nullptr) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+  task->PostEvents(events);
+  WakeupAndUnpin(task);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::WaitTimeout(uint64_t id, unsigned long deadline) {
+  Task *task = PinTask(id);
+  if (task == nullptr) {
+    return;
+  }
+
+  bool waiting;
+  {
+    SpinLockGuard guard{task->msg_lock_};
+    waiting = task->wait_deadline_ == deadline;
+  }
+  if (waiting) {
+    WakeupAndUnpin(task);
+  } else {
+    UnpinTask(task);
+  }
+}
+
+// Queues the task on the run queue of task->cpu_.
+void TaskManager::Enqueue(Task *task, int level) {
+  auto &rq = cpus_[task->cpu_];
+  task->enqueue_tsc_ = ReadTSC();
+  if (level == kFairLevel) {
+    // A task that slept for a while must not monopolize the CPU to catch up.
+    task->vruntime_ = std::max(task->vruntime_, rq.min_vruntime);
+    rq.running[level].InsertByVruntime(task);
+  } else if (level == kDeadlineLevel) {
+    rq.running[level].InsertByDeadline(task);
+  } else {
+    rq.running[level].PushBack(task);
+  }
+  rq.ready_levels |= uint64_t{1} << level;
+}
+
+void TaskManager::Dequeue(Task *task) {
+  auto &rq = cpus_[task->cpu_];
+  auto &queue = rq.running[task->Level()];
+  queue.Remove(task);
+  if (queue.Empty()) {
+    rq.ready_levels &= ~(uint64_t{1} << task->Level());
+  }
+}
+
+void TaskManager::ChargeSlice(Task *task, uint64_t now) {
+  const uint64_t slice = now - task->dispatch_tsc_;
+  task->stats_.slice.Record(slice);
+  task->cpu_cycles_ += slice;
+  task->vruntime_ += slice * Task::kDefaultWeight / task->weight_;
+  level_stats_[task->Level()].slice.Record(slice);
+}
+
+void TaskManager::Dispatch(Task *task, uint64_t now) {
+  auto &level_stats = level_stats_[task->Level()];
+  const uint64_t run_delay = now - task->enqueue_tsc_;
+  task->stats_.run_delay.Record(run_delay);
+  level_stats.run_delay.Record(run_delay);
+
+  if (task->wakeup_tsc_ != 0) {
+    const uint64_t latency = now - task->wakeup_tsc_;
+    task->stats_.wakeup_latency.Record(latency);
+    level_stats.wakeup_latency.Record(latency);
+    task->wakeup_tsc_ = 0;
+  }
+
+  auto &rq = cpus_[task->cpu_];
+  if (task->Level() == kFairLevel) {
+    rq.min_vruntime = std::max(rq.min_vruntime, task->vruntime_);
+  }
+
+  task->dispatch_tsc_ = now;
+  rq.slice_end = now + (task->dl_runtime_ != 0
+    ? task->dl_budget_ : level_slice_[task->Level()] * CyclesPerTick());
+}
@@ -4,12 +4,17 @@
 #include <cstddef>
 #include <cstdint>
 #include <deque>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <vector>
 
 #include "error.hpp"
+#include "histogram.hpp"
 #include "message.hpp"
+#include "smp.hpp"
+#include "sync.hpp"
+#include "timer.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1;             // offset 0x00
@@ -21,12 +26,44 @@ struct TaskContext {
 
 using TaskFunc = void (uint64_t, int64_t);
 
+// Scheduler latency histograms, in TSC cycles.
+struct SchedStats {
+  Histogram run_delay;       // enqueue -> dispatch
+  Histogram wakeup_latency;  // wakeup -> dispatch
+  Histogram slice;           // dispatch -> switch out
+};
+
+// Cumulative CPU usage of a task, sampled at every context switch.
+struct TaskUsage {
+  uint64_t id;
+  int cpu;
+  int level;
+  bool running;
+  uint64_t cpu_cycles;
+  uint64_t switches;
+  uint64_t wakeups;
+};
+
 class TaskManager;
 
 class Task {
  public:
   static const int kDefaultLevel = 1;
+  static const unsigned int kDefaultWeight = 1024;
   static const size_t kDefaultStackBytes = 4096;
+  static const unsigned long kNoTimeout = std::numeric_limits<unsigned long>::max();
+  // Most kernel subsystems still assume a single CPU, so tasks stay on the
+  // BSP unless they opt in with SetAffinity().
+  static const uint64_t kDefaultAffinity = 1;
+
+  // Event sources for Wait(). kEventMessage is pending while the mailbox is
+  // not empty; kEventTimeout is returned when the wait deadline passes.
+  enum Event : uint32_t {
+    kEventMessage = 1u << 0,
+    kEventTimeout = 1u << 1,
+    kEventIRQ     = 1u << 2,
+    kEventWork    = 1u << 3,
+  };
 
   Task(uint64_t id);
   Task &InitContext(TaskFunc *f, int64_t data);
@@ -36,47 +73,191 @@ class Task {
   Task &Wakeup();
   void SendMessage(const Message &msg);
   std::optional<Message> ReceiveMessage();
+  size_t ReceiveMessages(Message *buf, size_t n);
+  void Signal(uint32_t events);
+  uint32_t Wait(uint32_t events, unsigned long timeout = kNoTimeout);
+  void Exit();
+  Error SetAffinity(uint64_t cpu_mask);
+  Error SetDeadline(unsigned long runtime, unsigned long deadline, unsigned long period);
 
   int Level() const { return level_; }
+  unsigned int Weight() const { return weight_; }
   bool Running() const { return running_; }
+  uint64_t Affinity() const { return affinity_; }
+  int CPU() const { return cpu_; }
 
  private:
   uint64_t id_;
   std::vector<uint64_t> stack_;
   alignas(16) TaskContext context_;
+  SpinLock msg_lock_;  // guards msgs_, events_, wait_deadline_ and wait_timer_
   std::deque<Message> msgs_;
   unsigned int level_{kDefaultLevel};
+  unsigned int weight_{kDefaultWeight};
+  uint64_t vruntime_{0};  // weighted TSC cycles, used in the fair level
   bool running_{false};
+  bool exited_{false};
+  unsigned int pins_{0};  // PinTask() users; Reap() skips the task until 0
+  uint64_t affinity_{kDefaultAffinity};  // bit n: may run on CPU n
+  int cpu_{0};  // CPU whose run queue holds or last held the task
+  uint32_t events_{0};
+  unsigned long wait_deadline_{0};
+  TimerHandle wait_timer_{0};
+
+  // Deadline reservation, in timer ticks. dl_runtime_ is 0 for tasks outside
+  // the deadline level.
+  unsigned long dl_runtime_{0}, dl_deadline_{0}, dl_period_{0};
+  unsigned long dl_abs_deadline_{0}, dl_replenish_tick_{0};
+  uint64_t dl_budget_{0};  // TSC cycles left in the current period
+  uint64_t dl_bandwidth_{0};
+  bool dl_throttled_{false};  // budget used up; off the run queue until replenished
+
+  uint64_t wakeup_tsc_{0}, enqueue_tsc_{0}, dispatch_tsc_{0};
+  SchedStats stats_{};
+  uint64_t cpu_cycles_{0}, switches_{0}, wakeups_{0};
+
+  Task *run_prev_{nullptr}, *run_next_{nullptr};
+  // Search tree links of sorted RunLists, keyed on run_key_.
+  Task *tree_parent_{nullptr}, *tree_left_{nullptr}, *tree_right_{nullptr};
+  uint64_t run_key_{0};
+  Task *wait_next_{nullptr};
 
   Task &SetLevel(int level) { level_ = level; return *this; }
   Task &SetRunning(bool running) { running_ = running; return *this; }
+  uint32_t WaitEvents(uint32_t events, unsigned long timeout);
+  std::optional<Message> PopMessage();
+  void PushMessage(const Message &msg);
+  void PostEvents(uint32_t events);
 
   friend TaskManager;
+  friend class RunList;
+  friend WaitQueue;
+};
+
+// Intrusive list of runnable tasks linked through Task::run_prev_/run_next_.
+// A list is either a FIFO, filled by PushBack(), or kept sorted by
+// InsertByVruntime() or InsertByDeadline(). Sorted lists also index their
+// tasks in a treap, so that inserting and removing take O(log n) expected
+// time rather than a walk of the list; Front() and iteration use the list.
+class RunList {
+ public:
+  bool Empty() const { return head_ == nullptr; }
+  Task *Front() const { return head_; }
+  void PushBack(Task *task);
+  void InsertByVruntime(Task *task);
+  void InsertByDeadline(Task *task);
+  void Remove(Task *task);
+
+ private:
+  Task *head_{nullptr}, *tail_{nullptr};
+  Task *root_{nullptr};  // treap of a sorted list; max-heap on TreePriority()
+
+  void InsertAfter(Task *prev, Task *task);
+  void InsertSorted(Task *task, uint64_t key);
+  void TreeRemove(Task *task);
+  void RotateUp(Task *task);
 };
 
 class TaskManager {
  public:
-  static const int kMaxLevel = 3;
+  static const int kMaxLevel = 63;
+  // Tasks in this level share the CPU in proportion to their weights and are
+  // picked by the smallest virtual runtime. Other levels are strict
+  // round-robin.
+  static const int kFairLevel = Task::kDefaultLevel;
+  // Tasks with a deadline reservation run here, earliest deadline first. The
+  // level is reserved for them; other tasks cannot be moved into it.
+  static const int kDeadlineLevel = kFairLevel + 1;
 
   TaskManager();
   Task &NewTask();
-  void SwitchTask(bool current_sleep = false);
+  void SwitchTask();
+  void FinishSwitch();
+  void NewIdleTask(int cpu);
+  void RunIdle(int cpu);
 
   void Sleep(Task *task);
+  void Sleep(Task *task, SpinLock &lock);
   Error Sleep(uint64_t id);
   void Wakeup(Task *task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
+  Error SetAffinity(Task *task, uint64_t cpu_mask);
+  uint64_t OnlineCPUs();
+  Error SetDeadline(Task *task, unsigned long runtime,
+                    unsigned long deadline, unsigned long period);
+  Error SetDeadline(uint64_t id, unsigned long runtime,
+                    unsigned long deadline, unsigned long period);
+  void ReplenishDeadline(uint64_t id, unsigned long tick);
   Error SendMessage(uint64_t id, const Message &msg);
+  Error Signal(uint64_t id, uint32_t events);
+  void WaitTimeout(uint64_t id, unsigned long deadline);
+  void Exit(Task *task);
+  bool Reap();
   Task &CurrentTask();
+  bool IsIdle();
+  void ReschedIfNeeded();
+  bool SliceExpired() const;
+  std::vector<TaskUsage> Usage();
+  std::optional<SchedStats> TaskStats(uint64_t id);
+  SchedStats LevelStats(int level);
+  Histogram SwitchCost();
 
  private:
+  // Scheduling state of one CPU.
+  struct RunQueue {
+    std::array<RunList, kMaxLevel + 1> running{};
+    uint64_t ready_levels{0};  // bit n is set while running[n] is not empty
+    Task *current{nullptr};
+    Task *idle{nullptr};
+    bool need_resched{false};  // a task above the current level became ready
+    // TSC at which the current task's slice ends. Slices are measured with
+    // the CPU's own TSC, since only the BSP advances the timer tick and it
+    // stops while the BSP is tickless.
+    uint64_t slice_end{0};
+    uint64_t min_vruntime{0};
+    uint64_t switch_start_tsc{0};
+    uint64_t dl_bandwidth{0};  // admitted deadline reservations
+  };
+
+  // Guards everything below and the scheduling fields of every Task. It is
+  // held across SwitchContext and released by the task switched to, so a
+  // task cannot be picked by another CPU before its context is saved.
+  SpinLock lock_;
   std::vector<std::unique_ptr<Task>> tasks_{};
+  std::vector<Task *> zombies_{};
+  std::vector<uint64_t> free_ids_{};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task *>, kMaxLevel + 1> running_{};
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  std::array<RunQueue, kMaxCPUs> cpus_{};
+  uint64_t online_cpus_{1};
+  std::array<unsigned long, kMaxLevel + 1> level_slice_{};  // in ticks
+
+  std::array<SchedStats, kMaxLevel + 1> level_stats_{};
+  Histogram switch_cost_{};
 
+  void Switch(bool current_sleep);
+  void SleepLocked(Task *task);
+  void WakeupLocked(Task *task, int level);
+  Task *FindTaskLocked(uint64_t id);
+  Task *PinTask(uint64_t id);
+  void UnpinTask(Task *task);
+  void WakeupAndUnpin(Task *task);
+  Error SetDeadlineLocked(Task *task, unsigned long runtime,
+                          unsigned long deadline, unsigned long period);
   void ChangeLevelRunning(Task *task, int level);
+  int SelectCPU(const Task *task) const;
+  void MoveToCPU(Task *task, int cpu);
+  void Migrate(Task *task, int cpu);
+  Task *FindPullable(int cpu);
+  void PullTask(int cpu);
+  void CheckPreempt(const Task *task);
+  void StartDeadlinePeriod(Task *task, unsigned long start);
+  void ChargeDeadline(Task *task, uint64_t now);
+  void Throttle(Task *task);
+  bool OnCPU(const Task *task) const;
+  void Enqueue(Task *task, int level);
+  void Dequeue(Task *task);
+  void ChargeSlice(Task *task, uint64_t now);
+  void Dispatch(Task *task, uint64_t now);
 };
 
 extern TaskManager *task_manager;
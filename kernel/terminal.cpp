@@ -1,14 +1,21 @@
+#include <cstdlib>
 #include <cstring>
 #include "asmfunc.h"
 #include "elf.hpp"
 #include "fat.hpp"
+#include "fiber.hpp"
+#include "interrupt.hpp"
 #include "font.hpp"
+#include "keyboard.hpp"
+#include "ktime.hpp"
 #include "layer.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "segment.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
+#include "timer.hpp"
 
 namespace {
 
@@ -53,6 +60,121 @@ namespace {
     return 0;
   }
 
+  FiberScheduler *bench_fibers;
+
+  void BenchFiberYield(int64_t yields) {
+    for (int64_t i = 0; i < yields; ++i) {
+      bench_fibers->Yield();
+    }
+  }
+
+  // Returns the average TSC cycles of a fiber yield (fiber -> host -> fiber).
+  uint64_t BenchFiber(int64_t yields) {
+    FiberScheduler fibers{2};
+    bench_fibers = &fibers;
+    fibers.Spawn(BenchFiberYield, yields);
+    fibers.Spawn(BenchFiberYield, yields);
+
+    const uint64_t start = ReadTSC();
+    fibers.Run();
+    return (ReadTSC() - start) / (2 * yields);
+  }
+
+  using SwitchContextFunc = void (void *, void *);
+
+  alignas(16) TaskContext bench_main_ctx, bench_partner_ctx;
+  alignas(16) uint64_t bench_partner_stack[512];
+  SwitchContextFunc *bench_switch;
+
+  void BenchSwitchPartner() {
+    while (true) {
+      bench_switch(&bench_main_ctx, &bench_partner_ctx);
+    }
+  }
+
+  // Returns the average TSC cycles of one switch between two kernel
+  // contexts that share page tables and segments.
+  uint64_t BenchSwitch(SwitchContextFunc *switch_context, int switches) {
+    bench_switch = switch_context;
+
+    memset(&bench_partner_ctx, 0, sizeof(bench_partner_ctx));
+    bench_partner_ctx.cr3 = GetCR3();
+    bench_partner_ctx.rflags = 0x2;
+    bench_partner_ctx.cs = kKernelCS;
+    bench_partner_ctx.ss = kKernelSS;
+    bench_partner_ctx.rsp = reinterpret_cast<uint64_t>(&bench_partner_stack[512]) - 8;
+    bench_partner_ctx.rip = reinterpret_cast<uint64_t>(BenchSwitchPartner);
+    *reinterpret_cast<uint32_t *>(&bench_partner_ctx.fxsave_area[24]) = 0x1f80;
+
+    const uint64_t flags = SaveAndDisableInterrupts();
+    const uint64_t start = ReadTSC();
+    for (int i = 0; i < switches; i += 2) {
+      switch_context(&bench_partner_ctx, &bench_main_ctx);
+    }
+    const uint64_t elapsed = ReadTSC() - start;
+    RestoreInterrupts(flags);
+
+    return elapsed / switches;
+  }
+
+  // Returns the TSC cycles of each tick of a private TimerManager that holds
+  // `timers` timers spread over ten minutes. The few that expire are sent to
+  // a task ID that does not exist, and dropped.
+  Histogram BenchTimerTick(int timers, int ticks) {
+    auto manager = std::make_unique<TimerManager>(false);
+    for (int i = 0; i < timers; ++i) {
+      const unsigned long timeout = 1 + (i * 7919ul) % (kTimerFreq * 600);
+      manager->AddTimer(Timer{timeout, i, ~uint64_t{0}});
+    }
+
+    Histogram cost;
+    for (int i = 0; i < ticks; ++i) {
+      const uint64_t start = ReadTSC();
+      manager->Tick();
+      manager->Expire();
+      cost.Record(ReadTSC() - start);
+    }
+    return cost;
+  }
+
+  // Returns the first check that fails, or nullptr.
+  const char *CheckTimerCoalescing() {
+    auto manager = std::make_unique<TimerManager>(false);
+    // Timers without slack are never counted, even when they share a
+    // timeout or are caught up in one go after tickless idle.
+    for (int i = 0; i < 200; ++i) {
+      manager->AddTimer(Timer{1ul + i % 100, i, ~uint64_t{0}});
+    }
+    for (int i = 0; i < 50; ++i) {
+      manager->Tick();
+    }
+    manager->Advance(1000);
+    manager->Expire();
+    TimerStats stats = manager->Stats();
+    if (stats.delivered != 200) {
+      return "no slack: not all delivered";
+    }
+    if (stats.coalesced != 0) {
+      return "no slack: coalesced";
+    }
+
+    // Timers one tick apart are moved onto shared ticks by their slack.
+    const unsigned long now = manager->CurrentTick();
+    for (int i = 0; i < 64; ++i) {
+      manager->AddTimer(Timer{now + 1 + i, i, ~uint64_t{0}, 64});
+    }
+    manager->Advance(200);
+    manager->Expire();
+    stats = manager->Stats();
+    if (stats.delivered != 264) {
+      return "slack: not all delivered";
+    }
+    if (stats.coalesced == 0) {
+      return "slack: not coalesced";
+    }
+    return nullptr;
+  }
+
   static_assert(kBytesPerFrame >= 4096);
 
   WithError<PageMapEntry *> NewPageMap() {
@@ -218,6 +340,11 @@ Terminal::Terminal() {
 }
 
 Rectangle<int> Terminal::BlinkCursor() {
+  if (top_mode_) {
+    RefreshTop();
+    return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+  }
+
   cursor_visible_ = !cursor_visible_;
   DrawCursor(cursor_visible_);
   return {CalcCursorPos(), {7, 15}};
@@ -233,6 +360,14 @@ Vector2D<int> Terminal::CalcCursorPos() const {
 }
 
 Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii) {
+  if (top_mode_) {
+    top_mode_ = false;
+    top_prev_.clear();
+    Clear();
+    Print("> ");
+    return {ToplevelWindow::kTopLeftMargin, window_->InnerSize()};
+  }
+
   DrawCursor(false);
 
   Rectangle<int> draw_area{CalcCursorPos(), {8 * 2, 16}};
@@ -312,8 +447,16 @@ void Terminal::ExecuteLine() {
     Print("\n");
 
   } else if (strcmp(command, "clear") == 0) {
-    FillRectangle(*window_->InnerWriter(), {4, 4}, {kColumns * 8, kRows * 16}, ToColor(0));
-    cursor_.y = 0;
+    Clear();
+
+  } else if (strcmp(command, "top") == 0) {
+    top_mode_ = true;
+    top_prev_ = task_manager->Usage();
+    top_tsc_ = ReadTSC();
+    Print("collecting...\n");
+
+  } else if (strcmp(command, "exit") == 0) {
+    exit_requested_ = true;
 
   } else if (strcmp(command, "lspci") == 0) {
     char s[64];
@@ -379,6 +522,144 @@ void Terminal::ExecuteLine() {
       DrawCursor(true);
     }
 
+  } else if (strcmp(command, "schedstat") == 0) {
+    char s[64];
+    if (first_arg) {
+      const uint64_t task_id = strtoul(first_arg, nullptr, 0);
+      const auto stats = task_manager->TaskStats(task_id);
+      if (!stats) {
+        sprintf(s, "no such task: %s\n", first_arg);
+        Print(s);
+      } else {
+        sprintf(s, "task %lu (TSC cycles)\n", task_id);
+        Print(s);
+        PrintHistogram("run-queue", stats->run_delay);
+        PrintHistogram("wakeup", stats->wakeup_latency);
+        PrintHistogram("slice", stats->slice);
+      }
+    } else {
+      for (int lv = TaskManager::kMaxLevel; lv >= 0; --lv) {
+        const SchedStats stats = task_manager->LevelStats(lv);
+        if (stats.slice.Count() == 0 && stats.run_delay.Count() == 0) {
+          continue;
+        }
+
+        sprintf(s, "level %d (TSC cycles)\n", lv);
+        Print(s);
+        PrintHistogram("run-queue", stats.run_delay);
+        PrintHistogram("wakeup", stats.wakeup_latency);
+        PrintHistogram("slice", stats.slice);
+      }
+
+      PrintHistogram("switch", task_manager->SwitchCost());
+      PrintHistogram("key", KeyLatency());
+    }
+
+  } else if (strcmp(command, "lockstat") == 0) {
+    char s[64];
+    Print("lock stats (TSC cycles)\n");
+    for (auto stats = lock_stats_list; stats; stats = stats->next) {
+      sprintf(s, "%s: acquired=%lu contended=%lu\n",
+          stats->name, stats->acquisitions, stats->contentions);
+      Print(s);
+      PrintHistogram("hold", stats->hold);
+      PrintHistogram("wait", stats->wait);
+    }
+
+  } else if (strcmp(command, "irqstat") == 0) {
+    char s[64];
+    Print("interrupt stats (TSC cycles)\n");
+    for (int vector = 0; vector < 256; ++vector) {
+      const IRQStats stats = GetIRQStats(vector);
+      if (stats.count == 0) {
+        continue;
+      }
+      sprintf(s, "vector 0x%02x: count=%lu\n", vector, stats.count);
+      Print(s);
+      PrintHistogram("handler", stats.duration);
+    }
+    const IRQOffStats off = GetIRQOffStats();
+    sprintf(s, "interrupts off: max=%lu in %.24s\n",
+        off.max, off.max_site ? off.max_site : "-");
+    Print(s);
+    PrintHistogram("off", off.duration);
+
+  } else if (strcmp(command, "timerstat") == 0) {
+    char s[64];
+    const TimerStats stats = timer_manager->Stats();
+    sprintf(s, "added=%lu cancelled=%lu delivered=%lu\n",
+        stats.added, stats.cancelled, stats.delivered);
+    Print(s);
+    // coalesced: wakeups saved by moving timers onto a shared tick
+    sprintf(s, "wakeups=%lu coalesced=%lu\n", stats.expiry_wakeups, stats.coalesced);
+    Print(s);
+
+  } else if (strcmp(command, "timertest") == 0) {
+    if (const char *failed = CheckTimerCoalescing()) {
+      Print("timertest: FAILED: ");
+      Print(failed);
+      Print("\n");
+    } else {
+      Print("timertest: ok\n");
+    }
+
+  } else if (strcmp(command, "uptime") == 0) {
+    char s[64];
+    const uint64_t now = ktime::Now();
+    sprintf(s, "%lu.%06lu s, tick %lu, TSC %lu kHz\n",
+        now / ktime::kNanosecondsPerSecond, now % ktime::kNanosecondsPerSecond / 1000,
+        timer_manager->CurrentTick(), ktime::TSCFrequency() / 1000);
+    Print(s);
+    Print(ktime::CurrentClockSource() == ktime::ClockSource::kHPET ?
+          "clock source: HPET\n" : "clock source: TSC\n");
+
+  } else if (strcmp(command, "cpus") == 0) {
+    char s[64];
+    Print("CPU APIC   SWITCHES      TICKS\n");
+    const uint64_t online = task_manager->OnlineCPUs();
+    for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+      if ((online >> cpu) & 1) {
+        const PerCPU &p = per_cpu[cpu];
+        sprintf(s, "%3d %4u %10lu %10lu\n", cpu, p.apic_id, p.switches, p.ticks);
+        Print(s);
+      }
+    }
+
+  } else if (strcmp(command, "deadline") == 0) {
+    char s[64];
+    char *p = first_arg;
+    unsigned long args[4] = {};
+    int num_args = 0;
+    while (p && *p && num_args < 4) {
+      args[num_args++] = strtoul(p, &p, 0);
+    }
+    if (num_args == 2 && args[1] == 0) {
+      num_args = 4;
+    }
+    if (num_args < 4) {
+      Print("usage: deadline <task id> <runtime> <deadline> <period>\n");
+      Print("       deadline <task id> 0\n");
+    } else if (auto err = task_manager->SetDeadline(args[0], args[1], args[2], args[3])) {
+      sprintf(s, "deadline: %s\n", err.Name());
+      Print(s);
+    }
+
+  } else if (strcmp(command, "bench") == 0) {
+    char s[64];
+    if (first_arg && strcmp(first_arg, "fiber") == 0) {
+      sprintf(s, "fiber yield: %lu cycles\n", BenchFiber(100000));
+      Print(s);
+    } else if (first_arg && strcmp(first_arg, "switch") == 0) {
+      sprintf(s, "switch full: %lu cycles\n", BenchSwitch(SwitchContext, 100000));
+      Print(s);
+      sprintf(s, "switch fast: %lu cycles\n", BenchSwitch(SwitchContextFast, 100000));
+      Print(s);
+    } else if (first_arg && strcmp(first_arg, "timer") == 0) {
+      PrintHistogram("tick", BenchTimerTick(10000, 1000));
+    } else {
+      Print("usage: bench fiber|switch|timer\n");
+    }
+
   } else if (command[0] != 0) {
     auto file_entry = fat::FindFile(command);
     if (!file_entry) {
@@ -410,6 +691,11 @@ Error Terminal::ExecuteFile(const fat::DirectoryEntry &file_entry, char *command
   if (auto err = LoadELF(elf_header)) {
     return err;
   }
+  // Freed with the rest of the app's pages by CleanPageMaps().
+  if (auto err = SetupPageMaps(LinearAddress4Level{ktime::kClockPageAddress}, 1)) {
+    return err;
+  }
+  ktime::FillClockPage(*reinterpret_cast<ktime::ClockPage *>(ktime::kClockPageAddress));
 
   auto entry_addr = elf_header->e_entry;
   using Func = int (int, char **);
@@ -459,6 +745,51 @@ void Terminal::Print(const char *s) {
   DrawCursor(true);
 }
 
+void Terminal::Clear() {
+  FillRectangle(*window_->InnerWriter(), {4, 4}, {kColumns * 8, kRows * 16}, ToColor(0));
+  cursor_ = {0, 0};
+}
+
+// Redraws the whole window with the CPU share of each task since the
+// previous refresh. Called on every cursor blink timer while in top mode.
+void Terminal::RefreshTop() {
+  auto usage = task_manager->Usage();
+  const uint64_t now = ReadTSC();
+
+  const uint64_t elapsed = std::max<uint64_t>(now - top_tsc_, 1);
+
+  Clear();
+  Print("  ID CPU  LV ST   CPU%   SWITCH   WAKEUP  (any key to quit)\n");
+
+  char s[64];
+  for (int i = 0; i < usage.size() && i < kRows - 2; ++i) {
+    const auto &u = usage[i];
+    auto prev = std::find_if(top_prev_.begin(), top_prev_.end(),
+                             [&u](const auto &p){ return p.id == u.id; });
+    uint64_t cycles = u.cpu_cycles;
+    if (prev != top_prev_.end() && prev->cpu_cycles <= cycles) {
+      cycles -= prev->cpu_cycles;
+    }
+    const uint64_t permille = std::min<uint64_t>(cycles * 1000 / elapsed, 1000);
+
+    sprintf(s, "%4lu %3d %3d  %c %4lu.%lu %8lu %8lu\n",
+        u.id, u.cpu, u.level, u.running ? 'R' : 'S', permille / 10, permille % 10,
+        u.switches, u.wakeups);
+    Print(s);
+  }
+  DrawCursor(false);
+
+  top_prev_ = std::move(usage);
+  top_tsc_ = now;
+}
+
+void Terminal::PrintHistogram(const char *name, const Histogram &hist) {
+  char s[64];
+  sprintf(s, " %-9s n=%lu avg=%lu p99<%lu max=%lu\n",
+      name, hist.Count(), hist.Average(), hist.Percentile(99), hist.Max());
+  Print(s);
+}
+
 Rectangle<int> Terminal::HistoryUpDown(int direction) {
   if (direction == -1 && cmd_history_index_ >= 0) {
     --cmd_history_index_;
@@ -486,54 +817,66 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
 }
 
 void TaskTerminal(uint64_t task_id, int64_t data) {
-  __asm__("cli");
   Task &task = task_manager->CurrentTask();
+
+  // layer_manager has no lock of its own; keep the main task out while the
+  // window is set up.
+  DisableInterrupts();
   Terminal *terminal = new Terminal;
   layer_manager->Move(terminal->LayerID(), {100, 200});
   active_layer->Activate(terminal->LayerID());
-  layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-  __asm__("sti");
+  EnableInterrupts();
+
+  {
+    MutexGuard guard{layer_task_map_mutex};
+    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+  }
+
+  const int kCursorTimer = 1;
+  const unsigned long kCursorBlinkTicks = kTimerFreq / 2;
+  const unsigned long kCursorSlack = kCursorBlinkTicks / 10;
+  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kCursorBlinkTicks,
+                                kCursorTimer, 0, kCursorSlack});
 
+  std::array<Message, 8> msgs;
   while (true) {
-    __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg) {
-      task.Sleep();
-      __asm__("sti");
-      continue;
-    }
-    __asm__("sti");
-
-    switch (msg->type) {
-    case Message::kTimerTimeout:
-      {
-        const auto area = terminal->BlinkCursor();
-        Message msg = MakeLayerMessage(
-            task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-
-        __asm__("cli");
-        task_manager->SendMessage(1, msg);
-        __asm__("sti");
-      }
-      break;
+    task.Wait(Task::kEventMessage);
+
+    // Handle every pending message and ask the main task to redraw once.
+    Rectangle<int> dirty{};
+    const size_t num_msgs = task.ReceiveMessages(msgs.data(), msgs.size());
+    for (size_t i = 0; i < num_msgs; ++i) {
+      const Message *msg = &msgs[i];
+      switch (msg->type) {
+      case Message::kTimerTimeout:
+        if (msg->arg.timer.value == kCursorTimer) {
+          timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kCursorBlinkTicks,
+                                        kCursorTimer, 0, kCursorSlack});
+          dirty = dirty | terminal->BlinkCursor();
+        }
+        break;
 
-    case Message::kKeyPush:
-      {
-        const auto area = terminal->InputKey(msg->arg.keyboard.modifier,
-                                            msg->arg.keyboard.keycode,
-                                            msg->arg.keyboard.ascii);
+      case Message::kKeyPush:
+        dirty = dirty | terminal->InputKey(msg->arg.keyboard.modifier,
+                                           msg->arg.keyboard.keycode,
+                                           msg->arg.keyboard.ascii);
+        RecordKeyLatency(msg->arg.keyboard.irq_tsc);
 
-        Message msg = MakeLayerMessage(
-            task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
+        if (terminal->ExitRequested()) {
+          delete terminal;
+          task.Exit();
+        }
+        break;
 
-        __asm__("cli");
-        task_manager->SendMessage(1, msg);
-        __asm__("sti");
+      default:
+        break;
       }
-      break;
+    }
 
-    default:
-      break;
+    if (dirty.size.x > 0 && dirty.size.y > 0) {
+      Message msg = MakeLayerMessage(
+          task_id, terminal->LayerID(), LayerOperation::DrawArea, dirty);
+      task_manager->SendMessage(1, msg);
     }
   }
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "histogram.hpp"
+#include "task.hpp"
 #include "window.hpp"
 
 class Terminal {
@@ -9,6 +11,7 @@ class Terminal {
 
   Terminal();
   unsigned int LayerID() const { return layer_id_; };
+  bool ExitRequested() const { return exit_requested_; };
   Rectangle<int> BlinkCursor();
   Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
 
@@ -18,6 +21,9 @@ class Terminal {
   void Scroll1();
   void Print(const char c);
   void Print(const char *s);
+  void PrintHistogram(const char *name, const Histogram &hist);
+  void RefreshTop();
+  void Clear();
   void ExecuteLine();
   Error ExecuteFile(const fat::DirectoryEntry &file_entry, char *command, char *first_arg);
   Rectangle<int> HistoryUpDown(int direction);
@@ -30,6 +36,11 @@ class Terminal {
   std::array<char, kLineMax> linebuf_{};
   std::deque<std::array<char, kLineMax>> cmd_history_{};
   int cmd_history_index_{-1};
+  bool exit_requested_{false};
+
+  bool top_mode_{false};
+  uint64_t top_tsc_{0};
+  std::vector<TaskUsage> top_prev_{};
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
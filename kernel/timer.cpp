@@ -1,94 +1,726 @@
+#include <algorithm>
 #include <limits>
 
+#include <cpuid.h>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "hpet.hpp"
 #include "interrupt.hpp"
+#include "ktime.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "softirq.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
 namespace {
+  LockStats timer_lock_stats{"timer"};
+
   const uint32_t kCountMax = 0xffffffffu;
-  volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t *>(0xfee00320);
-  volatile uint32_t& initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
-  volatile uint32_t& current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
-  volatile uint32_t& divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+  // Ticks the wheel is stepped by with interrupts disabled at a time. The
+  // rest of a long catch-up after tickless idle is left to Expire().
+  const unsigned long kMaxCatchUpSteps = 64;
+
+  enum class TimerMode {
+    kPeriodic,
+    kTickless,  // one-shot until the next timer deadline
+    kResync,    // one-shot until the next tick boundary
+  };
+
+  TimerMode timer_mode = TimerMode::kPeriodic;
+  uint32_t tickless_count;  // initial count of the tickless one-shot
+  uint32_t tickless_first;  // counts until the first tick boundary in it
+
+  // In TSC-deadline mode every tick is armed at an exact TSC value derived
+  // from tick_base_tsc, so ticks do not drift and the tick counter is caught
+  // up from the TSC instead of from LAPIC counts.
+  const uint32_t kIA32TSCDeadline = 0x6e0;
+  const unsigned long kMaxTicklessTicks = kTimerFreq * 60;
+  bool tsc_deadline_mode = false;
+  uint64_t tick_base_tsc;
+
+  // With a TSC that is not invariant, the BSP is ticked by an HPET
+  // comparator instead, the same way, and its LAPIC timer stays masked.
+  bool hpet_mode = false;
+  uint64_t tick_base_hpet;
+
+  uint32_t CountPerTick() {
+    return lapic_timer_freq / kTimerFreq;
+  }
+
+  void StartPeriodic() {
+    // interrupt, periodic
+    lapic::Write(lapic::kLVTTimer, (0b010 << 16) | InterruptVector::kLAPICTimer);
+    lapic::Write(lapic::kInitialCount, CountPerTick());
+  }
+
+  void StartOneShot(uint32_t count) {
+    // interrupt, one-shot
+    lapic::Write(lapic::kLVTTimer, (0b000 << 16) | InterruptVector::kLAPICTimer);
+    lapic::Write(lapic::kInitialCount, count);
+  }
+
+  // From CPUID leaf 0x15, or 0x16 for the TSC when 0x15 lacks the crystal
+  // frequency. The LAPIC timer runs at the core crystal clock on CPUs that
+  // enumerate it. Not trusted under a hypervisor, whose LAPIC timer may run
+  // at any rate.
+  bool CalibrateFromCPUID(uint64_t &tsc_freq, unsigned long &lapic_freq) {
+    unsigned int max_leaf, eax, ebx, ecx, edx;
+    __cpuid(0, max_leaf, ebx, ecx, edx);
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (max_leaf < 0x15 || ((ecx >> 31) & 1)) {
+      return false;
+    }
+
+    unsigned int denominator, numerator, crystal;
+    __cpuid(0x15, denominator, numerator, crystal, edx);
+    if (denominator == 0 || numerator == 0) {
+      return false;
+    }
+    if (crystal == 0 && max_leaf >= 0x16) {
+      unsigned int base_mhz;
+      __cpuid(0x16, base_mhz, ebx, ecx, edx);
+      crystal = uint64_t{base_mhz} * 1000000 * denominator / numerator;
+    }
+    if (crystal == 0) {
+      return false;
+    }
+
+    tsc_freq = uint64_t{crystal} * numerator / denominator;
+    lapic_freq = crystal;
+    return true;
+  }
+
+  // Measures the TSC and the LAPIC timer against the ACPI PM timer over a few
+  // short windows, each started right after a PM timer edge. The spread of
+  // the per-window TSC frequencies bounds the error; if it is too wide, e.g.
+  // because of an SMI, falls back to one 100 ms window.
+  void CalibrateWithPMTimer(uint64_t &tsc_freq, unsigned long &lapic_freq) {
+    const int kWindows = 4;
+    const uint32_t kWindowTicks = acpi::kPMTimerFreq / 400;  // 2.5 ms
+    const uint64_t kMaxSpreadPPM = 500;
+    const uint32_t mask = acpi::PMTimerMask();
+
+    uint64_t pm_sum = 0, tsc_sum = 0, lapic_sum = 0;
+    uint64_t min_freq = std::numeric_limits<uint64_t>::max(), max_freq = 0;
+    StartLAPICTimer();
+    for (int i = 0; i < kWindows; ++i) {
+      const uint32_t pm_prev = acpi::ReadPMTimer();
+      uint32_t pm_start;
+      while ((pm_start = acpi::ReadPMTimer()) == pm_prev);
+      const uint64_t tsc_start = ReadTSC();
+      const uint32_t lapic_start = lapic::Read(lapic::kCurrentCount);
+
+      uint32_t pm_ticks;
+      while ((pm_ticks = (acpi::ReadPMTimer() - pm_start) & mask) < kWindowTicks);
+      const uint64_t tsc_ticks = ReadTSC() - tsc_start;
+      const uint32_t lapic_ticks = lapic_start - lapic::Read(lapic::kCurrentCount);
+
+      const uint64_t freq = tsc_ticks * acpi::kPMTimerFreq / pm_ticks;
+      min_freq = std::min(min_freq, freq);
+      max_freq = std::max(max_freq, freq);
+      pm_sum += pm_ticks;
+      tsc_sum += tsc_ticks;
+      lapic_sum += lapic_ticks;
+    }
+    StopLAPICTimer();
+
+    tsc_freq = tsc_sum * acpi::kPMTimerFreq / pm_sum;
+    lapic_freq = lapic_sum * acpi::kPMTimerFreq / pm_sum;
+    const uint64_t spread_ppm = (max_freq - min_freq) * 1000000 / tsc_freq;
+    Log(kInfo, "timer calibration: %d x 2.5 ms, spread %lu ppm\n", kWindows, spread_ppm);
+    if (spread_ppm <= kMaxSpreadPPM) {
+      return;
+    }
+
+    Log(kWarn, "timer calibration spread too wide, measuring for 100 ms\n");
+    const uint64_t tsc_start = ReadTSC();
+    StartLAPICTimer();
+    acpi::WaitMilliseconds(100);
+    const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = ReadTSC();
+    StopLAPICTimer();
+
+    tsc_freq = (tsc_end - tsc_start) * 10;
+    lapic_freq = static_cast<unsigned long>(elapsed) * 10;
+  }
+
+  bool TSCDeadlineSupported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ecx >> 24) & 1;
+  }
+
+  uint64_t TickToTSC(unsigned long tick) {
+    return tick_base_tsc +
+      static_cast<unsigned __int128>(tick) * ktime::TSCFrequency() / kTimerFreq;
+  }
+
+  unsigned long TSCToTick(uint64_t tsc) {
+    return static_cast<unsigned __int128>(tsc - tick_base_tsc) * kTimerFreq /
+      ktime::TSCFrequency();
+  }
+
+  // The interrupt fires once the TSC reaches the tick, at once if it
+  // already has. Reprogramming is this single MSR write.
+  void ArmDeadline(unsigned long tick) {
+    WriteMSR(kIA32TSCDeadline, TickToTSC(tick));
+  }
+
+  void StartTSCDeadline() {
+    // interrupt, TSC-deadline
+    lapic::Write(lapic::kLVTTimer, (0b100 << 16) | InterruptVector::kLAPICTimer);
+    // Make sure the mode switch is done before the deadline is written.
+    __asm__ volatile("mfence" ::: "memory");
+    ArmDeadline(TSCToTick(ReadTSC()) + 1);
+  }
+
+  // Advances the tick counter to the TSC and arms the next tick. Called on
+  // the BSP with interrupts disabled.
+  void CatchUpTSCDeadline() {
+    timer_mode = TimerMode::kPeriodic;
+    const unsigned long tick = TSCToTick(ReadTSC());
+    ArmDeadline(tick + 1);
+    const unsigned long current = timer_manager->CurrentTick();
+    if (tick > current) {
+      timer_manager->Advance(tick - current);
+    }
+  }
+
+  uint64_t TickToHPET(unsigned long tick) {
+    return tick_base_hpet +
+      static_cast<unsigned __int128>(tick) * hpet::Frequency() / kTimerFreq;
+  }
+
+  unsigned long HPETToTick(uint64_t counter) {
+    return static_cast<unsigned __int128>(counter - tick_base_hpet) * kTimerFreq /
+      hpet::Frequency();
+  }
+
+  // Returns false if the tick has already passed.
+  bool ArmHPET(unsigned long tick) {
+    return hpet::ArmOneShot(TickToHPET(tick));
+  }
+
+  // Advances the tick counter to the HPET and arms the next tick. Called on
+  // the BSP with interrupts disabled.
+  void CatchUpHPET() {
+    timer_mode = TimerMode::kPeriodic;
+    unsigned long tick;
+    do {
+      tick = HPETToTick(hpet::ReadCounter());
+    } while (!ArmHPET(tick + 1));
+    const unsigned long current = timer_manager->CurrentTick();
+    if (tick > current) {
+      timer_manager->Advance(tick - current);
+    }
+  }
 }
 
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager;
 
-  divide_config = 0b1011;  // divide 1:1
-  lvt_timer = 0b001 << 16;  // no interrupt, one-shot
+  lapic::Write(lapic::kDivideConfig, 0b1011);  // divide 1:1
+  lapic::Write(lapic::kLVTTimer, 0b001 << 16);  // no interrupt, one-shot
 
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  uint64_t tsc_freq;
+  if (!CalibrateFromCPUID(tsc_freq, lapic_timer_freq)) {
+    CalibrateWithPMTimer(tsc_freq, lapic_timer_freq);
+  }
+  ktime::Initialize(tsc_freq);
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  const bool invariant_tsc = ktime::InvariantTSC();
+  if (!invariant_tsc && hpet::Available()) {
+    ktime::SetClockSource(ktime::ClockSource::kHPET);
+  }
 
-  divide_config = 0b1011;  // divide 1:1
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;  // interrupt, periodic
-  initial_count = lapic_timer_freq / kTimerFreq;
+  lapic::Write(lapic::kDivideConfig, 0b1011);  // divide 1:1
+  if (!invariant_tsc && hpet::OneShotAvailable()) {
+    hpet_mode = true;
+    tick_base_hpet = hpet::ReadCounter();
+    CatchUpHPET();
+    Log(kInfo, "timer: HPET one-shot mode\n");
+  } else if (TSCDeadlineSupported()) {
+    tsc_deadline_mode = true;
+    tick_base_tsc = ReadTSC();
+    StartTSCDeadline();
+    Log(kInfo, "LAPIC timer: TSC-deadline mode\n");
+  } else {
+    StartPeriodic();
+  }
+}
+
+// Starts the periodic tick on an application processor. Its interrupts only
+// drive time slicing; the tick counter and timers are advanced by the BSP.
+void InitializeLAPICTimerAP() {
+  lapic::Write(lapic::kDivideConfig, 0b1011);  // divide 1:1
+  if (tsc_deadline_mode) {
+    StartTSCDeadline();
+  } else {
+    StartPeriodic();
+  }
 }
 
 void StartLAPICTimer() {
-  initial_count = kCountMax;
+  lapic::Write(lapic::kInitialCount, kCountMax);
 }
 
 void StopLAPICTimer() {
-  initial_count = 0;
+  lapic::Write(lapic::kInitialCount, 0);
 }
 
 uint32_t LAPICTimerElapsed() {
-  return kCountMax - current_count;
+  return kCountMax - lapic::Read(lapic::kCurrentCount);
+}
+
+// Replaces the periodic tick with a one-shot for the earliest timer deadline.
+// Must be called with interrupts disabled. Only the BSP goes tickless.
+void EnterTicklessIdle() {
+  if (timer_mode != TimerMode::kPeriodic || CurrentCPU() != 0) {
+    return;
+  }
+
+  const auto tick = timer_manager->CurrentTick();
+  const auto deadline = timer_manager->NextDeadline();
+  if (deadline <= tick + 1) {
+    return;
+  }
+
+  if (tsc_deadline_mode) {
+    timer_mode = TimerMode::kTickless;
+    ArmDeadline(std::min(deadline, tick + kMaxTicklessTicks));
+    return;
+  }
+  if (hpet_mode) {
+    timer_mode = TimerMode::kTickless;
+    if (!ArmHPET(std::min(deadline, tick + kMaxTicklessTicks))) {
+      CatchUpHPET();
+    }
+    return;
+  }
+
+  const uint32_t count_per_tick = CountPerTick();
+  const uint32_t first = lapic::Read(lapic::kCurrentCount);
+  if (first == 0) {
+    return;
+  }
+  const unsigned long max_ticks = (kCountMax - first) / count_per_tick + 1;
+  const unsigned long ticks = std::min(deadline - tick, max_ticks);
+
+  tickless_first = first;
+  tickless_count = first + (ticks - 1) * count_per_tick;
+  timer_mode = TimerMode::kTickless;
+  StartOneShot(tickless_count);
 }
 
-Timer::Timer(unsigned long timeout, int value) : timeout_{timeout}, value_{value} {}
+// Catches the tick counter up with the time spent tickless and realigns the
+// LAPIC timer to the next tick boundary. Must be called with interrupts
+// disabled.
+void ExitTicklessIdle() {
+  if (timer_mode != TimerMode::kTickless || CurrentCPU() != 0) {
+    return;
+  }
+
+  if (tsc_deadline_mode) {
+    CatchUpTSCDeadline();
+    return;
+  }
+  if (hpet_mode) {
+    CatchUpHPET();
+    return;
+  }
 
-TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+  const uint32_t count_per_tick = CountPerTick();
+  const uint32_t elapsed = tickless_count - lapic::Read(lapic::kCurrentCount);
+
+  unsigned long ticks = 0;
+  uint32_t next = tickless_first - elapsed;
+  if (elapsed >= tickless_first) {
+    const uint32_t after_first = elapsed - tickless_first;
+    ticks = 1 + after_first / count_per_tick;
+    next = count_per_tick - after_first % count_per_tick;
+  }
+
+  timer_mode = TimerMode::kResync;
+  StartOneShot(next);
+  timer_manager->Advance(ticks);
+}
+
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id, unsigned long slack)
+    : timeout_{timeout}, value_{value}, task_id_{task_id}, slack_{slack} {}
+
+// The tick in [timeout, timeout + slack] that is a multiple of the largest
+// power of two. Timers with overlapping slack windows mostly pick the same
+// tick and expire together.
+unsigned long Timer::Expiry() const {
+  const unsigned long last = timeout_ + std::min(slack_, ~timeout_);
+  if (last == timeout_) {
+    return timeout_;
+  }
+  const int bit = 63 - __builtin_clzl((timeout_ - 1) ^ last);
+  return last >> bit << bit;
 }
 
-void TimerManager::AddTimer(const Timer &timer) {
-  timers_.push(timer);
+TimerManager::TimerManager(bool raise_softirq)
+    : lock_{&timer_lock_stats}, raise_softirq_{raise_softirq} {
+  for (uint32_t i = 0; i < kMaxTimers; ++i) {
+    nodes_[i].generation = 0;
+    PushBack(kFreeList, i);
+  }
 }
 
-bool TimerManager::Tick() {
+WithError<TimerHandle> TimerManager::AddTimer(const Timer &timer) {
+  SpinLockGuard guard{lock_};
+  const uint32_t index = lists_[kFreeList].head;
+  if (index == kNil) {
+    return {0, MAKE_ERROR(Error::kFull)};
+  }
+
+  Remove(index);
+  Node &node = nodes_[index];
+  node.timer = timer;
+  if (timer.TaskID() == 0) {
+    node.timer = Timer{timer.Timeout(), timer.Value(),
+                       task_manager->CurrentTask().ID(), timer.Slack()};
+  }
+  ++node.generation;
+  ++stats_.added;
+  Insert(index);
+  return {(uint64_t{node.generation} << 32) | (index + 1), MAKE_ERROR(Error::kSuccess)};
+}
+
+// Returns false if the timer has already been delivered or cancelled.
+bool TimerManager::CancelTimer(TimerHandle handle) {
+  SpinLockGuard guard{lock_};
+  Node *node = FindNode(handle);
+  if (node == nullptr) {
+    return false;
+  }
+  const uint32_t index = node - &nodes_[0];
+  Remove(index);
+  PushBack(kFreeList, index);
+  ++stats_.cancelled;
+  return true;
+}
+
+// Cancels every timer owned by the task and returns how many there were.
+// Scans the whole pool, so it is meant for task exit, not for hot paths.
+size_t TimerManager::CancelTimers(uint64_t task_id) {
+  SpinLockGuard guard{lock_};
+  size_t count = 0;
+  for (uint32_t index = 0; index < kMaxTimers; ++index) {
+    if (nodes_[index].list != kFreeList && nodes_[index].timer.TaskID() == task_id) {
+      Remove(index);
+      PushBack(kFreeList, index);
+      ++count;
+    }
+  }
+  stats_.cancelled += count;
+  return count;
+}
+
+TimerStats TimerManager::Stats() const {
+  SpinLockGuard guard{lock_};
+  return stats_;
+}
+
+TimerManager::Node *TimerManager::FindNode(TimerHandle handle) {
+  const uint64_t index = (handle & 0xffffffffu) - 1;
+  if (index >= kMaxTimers) {
+    return nullptr;
+  }
+  Node &node = nodes_[index];
+  if (node.generation != handle >> 32 || node.list == kFreeList) {
+    return nullptr;
+  }
+  return &node;
+}
+
+void TimerManager::Tick() {
+  Advance(1);
+}
+
+// Only moves the due timers to the expired list. They are delivered by
+// Expire() in the timer softirq, with interrupts enabled.
+void TimerManager::Advance(unsigned long ticks) {
+  if (ticks == 0) {
+    return;
+  }
+  SpinLockGuard guard{lock_};
+  now_ += ticks;
+  const bool behind = CatchUp();
+  if (raise_softirq_ && (behind || lists_[kExpiredList].head != kNil)) {
+    RaiseSoftIRQ(kSoftIRQTimer);
+  }
+}
+
+// Steps the wheel towards now_ by at most kMaxCatchUpSteps ticks. Returns
+// true if it is still behind.
+bool TimerManager::CatchUp() {
+  for (unsigned long i = 0; i < kMaxCatchUpSteps && tick_ != now_; ++i) {
+    Step();
+  }
+  return tick_ != now_;
+}
+
+// Files the timer under the level and slot its timeout falls in, relative to
+// the current tick. Timeouts beyond the last level are filed at its far end
+// and filed again when they get there.
+void TimerManager::Insert(uint32_t index) {
+  const unsigned long timeout = nodes_[index].timer.Expiry();
+  if (timeout <= tick_) {
+    PushBack(kExpiredList, index);
+    return;
+  }
+
+  const unsigned long max_delta = (1ul << (kWheelBits * kWheelLevels)) - 1;
+  const unsigned long expires = tick_ + std::min(timeout - tick_, max_delta);
+  int level = 0;
+  while (((expires - tick_) >> (kWheelBits * (level + 1))) != 0) {
+    ++level;
+  }
+  const int slot = (expires >> (kWheelBits * level)) & (kWheelSlots - 1);
+  PushBack(level * kWheelSlots + slot, index);
+}
+
+void TimerManager::PushBack(uint16_t list, uint32_t index) {
+  Node &node = nodes_[index];
+  List &l = lists_[list];
+  node.list = list;
+  node.prev = l.tail;
+  node.next = kNil;
+  if (l.tail == kNil) {
+    l.head = index;
+  } else {
+    nodes_[l.tail].next = index;
+  }
+  l.tail = index;
+
+  if (list < kExpiredList) {
+    occupied_[list / kWheelSlots] |= uint64_t{1} << (list % kWheelSlots);
+  }
+}
+
+void TimerManager::Remove(uint32_t index) {
+  Node &node = nodes_[index];
+  List &l = lists_[node.list];
+  if (node.prev == kNil) {
+    l.head = node.next;
+  } else {
+    nodes_[node.prev].next = node.next;
+  }
+  if (node.next == kNil) {
+    l.tail = node.prev;
+  } else {
+    nodes_[node.next].prev = node.prev;
+  }
+
+  if (node.list < kExpiredList && l.head == kNil) {
+    occupied_[node.list / kWheelSlots] &= ~(uint64_t{1} << (node.list % kWheelSlots));
+  }
+}
+
+// Moves the timers in the current slot of the level down to lower levels.
+void TimerManager::Cascade(int level) {
+  const int slot = (tick_ >> (kWheelBits * level)) & (kWheelSlots - 1);
+  const uint16_t list = level * kWheelSlots + slot;
+  while (lists_[list].head != kNil) {
+    const uint32_t index = lists_[list].head;
+    Remove(index);
+    Insert(index);
+  }
+}
+
+// Advances the wheel by one tick and moves the timers due at it to the
+// expired list.
+void TimerManager::Step() {
   ++tick_;
+  const uint32_t last_expired = lists_[kExpiredList].tail;
+  for (int level = 1; level < kWheelLevels; ++level) {
+    if ((tick_ & ((1ul << (kWheelBits * level)) - 1)) != 0) {
+      break;
+    }
+    Cascade(level);
+  }
+
+  const uint16_t list = tick_ & (kWheelSlots - 1);
+  while (lists_[list].head != kNil) {
+    const uint32_t index = lists_[list].head;
+    Remove(index);
+    PushBack(kExpiredList, index);
+  }
+
+  if (last_expired == kNil && lists_[kExpiredList].head != kNil) {
+    ++stats_.expiry_wakeups;
+  }
+
+  // Slack saved a wakeup for each timer it moved onto this tick, except for
+  // one of them if no timer was due at this tick anyway.
+  unsigned long due = 0, moved = 0;
+  uint32_t index = last_expired == kNil ? lists_[kExpiredList].head : nodes_[last_expired].next;
+  for (; index != kNil; index = nodes_[index].next) {
+    const Timer &t = nodes_[index].timer;
+    ++(t.Expiry() != t.Timeout() ? moved : due);
+  }
+  if (moved > 0) {
+    stats_.coalesced += due > 0 ? moved : moved - 1;
+  }
+}
+
+// Delivers expired timers one at a time with the lock released, since
+// delivery takes the mailbox and scheduler locks.
+void TimerManager::Expire() {
+  // Finish the catch-up first, with interrupts enabled between the steps.
+  bool behind = true;
+  while (behind) {
+    const uint64_t flags = lock_.LockIRQSave();
+    behind = CatchUp();
+    lock_.UnlockIRQRestore(flags);
+  }
 
-  bool task_timer_timeout = false;
   while (true) {
-    const auto &t = timers_.top();
-    if (t.Timeout() > tick_) {
+    const uint64_t flags = lock_.LockIRQSave();
+    const uint32_t index = lists_[kExpiredList].head;
+    if (index == kNil) {
+      lock_.UnlockIRQRestore(flags);
       break;
     }
+    const Timer t = nodes_[index].timer;
+    Remove(index);
+    PushBack(kFreeList, index);
+    ++stats_.delivered;
+    lock_.UnlockIRQRestore(flags);
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+    if (t.Value() == kWaitTimerValue) {
+      task_manager->WaitTimeout(t.TaskID(), t.Timeout());
+      continue;
+    }
+    if (t.Value() == kDeadlineTimerValue) {
+      task_manager->ReplenishDeadline(t.TaskID(), t.Timeout());
       continue;
     }
 
     Message m{Message::kTimerTimeout};
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
-    task_manager->SendMessage(1, m);
+    task_manager->SendMessage(t.TaskID(), m);
+  }
+}
 
-    timers_.pop();
+// Returns a tick no later than the earliest timeout: exact for timers in the
+// first level, and the tick their slot is cascaded at for the others.
+unsigned long TimerManager::NextDeadline() const {
+  SpinLockGuard guard{lock_};
+  if (tick_ != now_ || lists_[kExpiredList].head != kNil) {
+    return now_;
   }
 
-  return task_timer_timeout;
+  unsigned long deadline = std::numeric_limits<unsigned long>::max();
+  for (int level = 0; level < kWheelLevels; ++level) {
+    if (occupied_[level] == 0) {
+      continue;
+    }
+    // Slots in the order they come up, starting with the next one.
+    const int shift = kWheelBits * level;
+    const unsigned long next = (tick_ >> shift) + 1;
+    const int rotate = next & (kWheelSlots - 1);
+    const uint64_t slots = (occupied_[level] >> rotate) |
+      (rotate ? occupied_[level] << (kWheelSlots - rotate) : 0);
+    const unsigned long at = (next + __builtin_ctzll(slots)) << shift;
+    deadline = std::min(deadline, at);
+  }
+  return deadline;
 }
 
 TimerManager *timer_manager;
 unsigned long lapic_timer_freq;
 
 void LAPICTimerInterrupt() {
-  const bool task_timer_timeout = timer_manager->Tick();
+  const uint64_t entry_tsc = ReadTSC();
+  ++ThisCPU()->ticks;
+  if (CurrentCPU() != 0) {
+    if (tsc_deadline_mode) {
+      ArmDeadline(TSCToTick(ReadTSC()) + 1);
+    }
+    NotifyEndOfInterrupt();
+    RecordIRQ(InterruptVector::kLAPICTimer, entry_tsc);
+    if (!RunSoftIRQs()) {
+      return;
+    }
+    if (task_manager->SliceExpired()) {
+      task_manager->SwitchTask();
+    } else {
+      task_manager->ReschedIfNeeded();
+    }
+    return;
+  }
+
+  if (tsc_deadline_mode) {
+    CatchUpTSCDeadline();
+  } else {
+    switch (timer_mode) {
+    case TimerMode::kPeriodic:
+      timer_manager->Tick();
+      break;
+    case TimerMode::kTickless:
+      if (lapic::Read(lapic::kCurrentCount) != 0) {
+        // a periodic tick that was already pending when going tickless
+        timer_manager->Tick();
+        break;
+      }
+      ExitTicklessIdle();
+      break;
+    case TimerMode::kResync:
+      if (lapic::Read(lapic::kCurrentCount) != 0) {
+        break;  // stale interrupt from the tickless one-shot
+      }
+      timer_mode = TimerMode::kPeriodic;
+      StartPeriodic();
+      timer_manager->Tick();
+      break;
+    }
+  }
   NotifyEndOfInterrupt();
+  RecordIRQ(InterruptVector::kLAPICTimer, entry_tsc);
+  // Ticks taken before InitializeTask() only advance time. The timer
+  // softirq stays pending until the scheduler exists.
+  if (task_manager == nullptr) {
+    return;
+  }
+  if (!RunSoftIRQs()) {
+    return;
+  }
+
+  if (task_manager->SliceExpired()) {
+    task_manager->SwitchTask();
+  } else {
+    task_manager->ReschedIfNeeded();
+  }
+}
+
+// The BSP's tick in HPET mode.
+void HPETTimerInterrupt() {
+  const uint64_t entry_tsc = ReadTSC();
+  ++ThisCPU()->ticks;
+  CatchUpHPET();
+  NotifyEndOfInterrupt();
+  RecordIRQ(InterruptVector::kHPETTimer, entry_tsc);
+  // Ticks taken before InitializeTask() only advance time. The timer
+  // softirq stays pending until the scheduler exists.
+  if (task_manager == nullptr) {
+    return;
+  }
+  if (!RunSoftIRQs()) {
+    return;
+  }
 
-  if (task_timer_timeout) {
+  if (task_manager->SliceExpired()) {
     task_manager->SwitchTask();
+  } else {
+    task_manager->ReschedIfNeeded();
   }
 }
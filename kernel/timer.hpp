@@ -1,47 +1,116 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <deque>
 #include <limits>
+#include "error.hpp"
 #include "message.hpp"
+#include "sync.hpp"
 
 void InitializeLAPICTimer();
+void InitializeLAPICTimerAP();
 void StartLAPICTimer();
 void StopLAPICTimer();
 uint32_t LAPICTimerElapsed();
+void EnterTicklessIdle();
+void ExitTicklessIdle();
 
+// Expires at the given tick. The expiry is sent as a kTimerTimeout message to
+// the task that owns the timer; task_id 0 makes the task that adds the timer
+// its owner. A timer with slack may expire up to that many ticks late, which
+// lets it share a wakeup with other timers.
 class Timer {
  public:
-  Timer(unsigned long timeout, int value);
+  Timer() = default;
+  Timer(unsigned long timeout, int value, uint64_t task_id = 0, unsigned long slack = 0);
   unsigned long Timeout() const { return timeout_; };
   int Value() const { return value_; };
+  uint64_t TaskID() const { return task_id_; };
+  unsigned long Slack() const { return slack_; };
+  unsigned long Expiry() const;
 
  private:
-  unsigned long timeout_;
-  int value_;
+  unsigned long timeout_{0};
+  int value_{0};
+  uint64_t task_id_{0};
+  unsigned long slack_{0};
 };
 
+struct TimerStats {
+  uint64_t added, cancelled, delivered;
+  uint64_t expiry_wakeups;  // timer interrupts that had timers to deliver
+  uint64_t coalesced;       // wakeups saved by moving timers by their slack
+};
+
+// Identifies an armed timer for CancelTimer(). 0 is never a valid handle.
+using TimerHandle = uint64_t;
+
+// Hierarchical timing wheel. Level n has 64 slots of 64^n ticks each, and a
+// timer sits in the level its remaining time falls in. When a level wraps,
+// the timers in its next slot are moved down a level. Adding, cancelling and
+// expiring a timer are O(1), and all timers live in a pool that is allocated
+// with the manager, so the timer interrupt never allocates.
 class TimerManager {
  public:
-  TimerManager();
-  void AddTimer(const Timer &timer);
-  bool Tick();
-  unsigned long CurrentTick() const { return tick_; };
+  static const size_t kMaxTimers = 16384;
+
+  // A manager that is not timer_manager, e.g. one for a benchmark, passes
+  // false so that its expiries do not run the timer softirq.
+  explicit TimerManager(bool raise_softirq = true);
+  WithError<TimerHandle> AddTimer(const Timer &timer);
+  bool CancelTimer(TimerHandle handle);
+  size_t CancelTimers(uint64_t task_id);
+  TimerStats Stats() const;
+  void Tick();
+  void Advance(unsigned long ticks);
+  void Expire();
+  unsigned long CurrentTick() const { return now_; };
+  unsigned long NextDeadline() const;
 
  private:
-  volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
-};
+  static const int kWheelBits = 6;
+  static const int kWheelSlots = 1 << kWheelBits;
+  static const int kWheelLevels = 5;
+  static const uint32_t kNil = 0xffffffffu;
+  // List indices besides the wheel slots, which are level * kWheelSlots + slot.
+  static const uint16_t kExpiredList = kWheelLevels * kWheelSlots;
+  static const uint16_t kFreeList = kExpiredList + 1;
 
-inline bool operator<(const Timer &lhs, const Timer &rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+  struct Node {
+    Timer timer;
+    uint32_t prev, next;
+    uint32_t generation;
+    uint16_t list;
+  };
+
+  struct List {
+    uint32_t head{kNil}, tail{kNil};
+  };
+
+  mutable SpinLock lock_;
+  const bool raise_softirq_;
+  volatile unsigned long tick_{0};  // of the wheel; behind now_ while catching up
+  volatile unsigned long now_{0};
+  std::array<Node, kMaxTimers> nodes_;
+  std::array<List, kFreeList + 1> lists_{};
+  std::array<uint64_t, kWheelLevels> occupied_{};  // bit n: slot n is not empty
+  TimerStats stats_{};
+
+  Node *FindNode(TimerHandle handle);
+  void Insert(uint32_t index);
+  void PushBack(uint16_t list, uint32_t index);
+  void Remove(uint32_t index);
+  void Cascade(int level);
+  void Step();
+  bool CatchUp();
+};
 
 extern TimerManager *timer_manager;
 extern unsigned long lapic_timer_freq;
 const int kTimerFreq = 100;
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
+const int kWaitTimerValue = std::numeric_limits<int>::min();
+const int kDeadlineTimerValue = kWaitTimerValue + 1;
 
 void LAPICTimerInterrupt();
+void HPETTimerInterrupt();